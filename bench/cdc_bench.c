@@ -0,0 +1,448 @@
+/*
+ * cdc_bench.c  --  benchmarks of the /dev/cdc interface
+ *
+ * Measures the register IOCTL throughput, the IRQ to read() wakeup latency,
+ * the commit to reload latency and the frame pacing and prints the results
+ * as JSON, so runs of different driver versions can be compared.
+ *
+ * The register benchmarks write CDC_REG_GLOBAL_CRC_REFERENCE, which has no
+ * effect unless CRC checking is enabled, and restore it afterwards. The
+ * latency benchmarks need a running video timing (or the simulated CDC,
+ * module parameter sim=1).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/ioctl.h>
+#include "../tes_cdc_driver.h"
+#include "../cdc_base.h"
+
+#define BENCH_REG			CDC_REG_GLOBAL_CRC_REFERENCE
+#define BENCH_MAX_SAMPLES	100000u
+
+typedef struct
+{
+	const char *name;
+	int (*run)(int fd, unsigned int iterations);
+} bench_test;
+
+static int bench_first_result = 1;
+
+static long long bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static void bench_result_begin(const char *name, const char *unit)
+{
+	printf("%s\n    {\"name\": \"%s\", \"unit\": \"%s\"",
+			bench_first_result ? "" : ",", name, unit);
+	bench_first_result = 0;
+}
+
+static void bench_result_end(void)
+{
+	printf("}");
+}
+
+/* throughput result: operations per second */
+static void bench_rate(const char *name, unsigned long long ops,
+		long long elapsed_ns)
+{
+	bench_result_begin(name, "ops/s");
+	printf(", \"ops\": %llu, \"elapsed_ns\": %lld, \"rate\": %.1f", ops,
+			elapsed_ns, elapsed_ns ? ops * 1e9 / elapsed_ns : 0.0);
+	bench_result_end();
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+	long long x = *(const long long *) a;
+	long long y = *(const long long *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* latency distribution in ns, sorts samples */
+static void bench_distribution(const char *name, long long *samples,
+		unsigned int count)
+{
+	double mean = 0, var = 0;
+	unsigned int i;
+
+	bench_result_begin(name, "ns");
+	printf(", \"samples\": %u", count);
+	if(count)
+	{
+		qsort(samples, count, sizeof(*samples), bench_compare);
+		for(i = 0; i < count; i++)
+			mean += samples[i];
+		mean /= count;
+		for(i = 0; i < count; i++)
+			var += (samples[i] - mean) * (samples[i] - mean);
+
+		printf(", \"min\": %lld, \"p50\": %lld, \"p90\": %lld, \"p99\": %lld, "
+				"\"max\": %lld, \"mean\": %.1f, \"stddev\": %.1f",
+				samples[0], samples[count / 2], samples[count * 9 / 10],
+				samples[count * 99 / 100], samples[count - 1], mean,
+				sqrt(var / count));
+	}
+	bench_result_end();
+}
+
+/* register writes: working register and write as two IOCTLs per access,
+ * as the cdc library does it, against batches of different sizes */
+static int bench_reg_write(int fd, unsigned int iterations)
+{
+	static const unsigned int sizes[] = { 1, 16, 256, CDC_REG_BATCH_MAX };
+	cdc_reg_pair pairs[CDC_REG_BATCH_MAX];
+	cdc_reg_batch batch;
+	unsigned long saved;
+	unsigned int i, s, n;
+	char name[64];
+	long long start;
+
+	if(ioctl(fd, CDC_IOCTL_SET_REG, BENCH_REG) || ioctl(fd, CDC_IOCTL_R, &saved))
+		return -errno;
+
+	start = bench_now_ns();
+	for(i = 0; i < iterations; i++)
+	{
+		if(ioctl(fd, CDC_IOCTL_SET_REG, BENCH_REG) || ioctl(fd, CDC_IOCTL_W, i))
+			return -errno;
+	}
+	bench_rate("reg_write_two_call", iterations, bench_now_ns() - start);
+
+	/* a changing value, the driver drops writes of the current value */
+	for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+	{
+		batch.count = sizes[s];
+		batch.pairs = pairs;
+		n = (iterations + sizes[s] - 1) / sizes[s];
+
+		start = bench_now_ns();
+		for(i = 0; i < n; i++)
+		{
+			unsigned int p;
+
+			for(p = 0; p < sizes[s]; p++)
+			{
+				pairs[p].reg = BENCH_REG;
+				pairs[p].value = i * sizes[s] + p;
+			}
+			if(ioctl(fd, CDC_IOCTL_W_BATCH, &batch))
+				return -errno;
+		}
+		snprintf(name, sizeof(name), "reg_write_batch_%u", sizes[s]);
+		bench_rate(name, (unsigned long long) n * sizes[s],
+				bench_now_ns() - start);
+	}
+
+	/* unchanged value: measures the path of writes the cache drops */
+	batch.count = 1;
+	pairs[0].reg = BENCH_REG;
+	pairs[0].value = (unsigned int) saved;
+	start = bench_now_ns();
+	for(i = 0; i < iterations; i++)
+	{
+		if(ioctl(fd, CDC_IOCTL_W_BATCH, &batch))
+			return -errno;
+	}
+	bench_rate("reg_write_batch_1_same", iterations, bench_now_ns() - start);
+
+	if(ioctl(fd, CDC_IOCTL_SET_REG, BENCH_REG) || ioctl(fd, CDC_IOCTL_W, saved))
+		return -errno;
+
+	return 0;
+}
+
+/* register reads: two IOCTLs per access against snapshots */
+static int bench_reg_read(int fd, unsigned int iterations)
+{
+	static const unsigned int sizes[] = { 1, 16, 64 };
+	unsigned int values[64];
+	cdc_reg_snapshot snap;
+	unsigned long value;
+	unsigned int i, s, n;
+	char name[64];
+	long long start;
+
+	start = bench_now_ns();
+	for(i = 0; i < iterations; i++)
+	{
+		if(ioctl(fd, CDC_IOCTL_SET_REG, BENCH_REG) ||
+				ioctl(fd, CDC_IOCTL_R, &value))
+			return -errno;
+	}
+	bench_rate("reg_read_two_call", iterations, bench_now_ns() - start);
+
+	/* consecutive global registers from the first one on */
+	for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+	{
+		memset(&snap, 0, sizeof(snap));
+		snap.count = sizes[s];
+		snap.values = values;
+		n = (iterations + sizes[s] - 1) / sizes[s];
+
+		start = bench_now_ns();
+		for(i = 0; i < n; i++)
+		{
+			if(ioctl(fd, CDC_IOCTL_R_BATCH, &snap))
+				return -errno;
+		}
+		snprintf(name, sizeof(name), "reg_read_batch_%u", sizes[s]);
+		bench_rate(name, (unsigned long long) n * sizes[s],
+				bench_now_ns() - start);
+	}
+
+	return 0;
+}
+
+/* time from the hard IRQ (event timestamp) until read() returned it */
+static int bench_irq_latency(int fd, unsigned int iterations)
+{
+	unsigned int mask = CDC_IRQ_LINE;
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	long long *samples;
+	unsigned int count = 0;
+	cdc_event event;
+	long long now;
+	int result = 0;
+
+	samples = calloc(iterations, sizeof(*samples));
+	if(!samples)
+		return -ENOMEM;
+
+	if(ioctl(fd, CDC_IOCTL_IRQ_SUBSCRIBE, mask))
+	{
+		free(samples);
+		return -errno;
+	}
+
+	/* drop what accumulated before */
+	while(poll(&pfd, 1, 0) > 0 && read(fd, &event, sizeof(event)) > 0)
+		;
+
+	while(count < iterations)
+	{
+		if(poll(&pfd, 1, 1000) <= 0)
+		{
+			result = -ETIMEDOUT;
+			break;
+		}
+		if(read(fd, &event, sizeof(event)) != sizeof(event) ||
+				!(event.status & CDC_IRQ_LINE))
+			continue;
+		now = bench_now_ns();
+		samples[count++] = now - event.timestamp;
+	}
+
+	mask = 0;
+	ioctl(fd, CDC_IOCTL_IRQ_SUBSCRIBE, mask);
+
+	if(!result)
+		bench_distribution("irq_wakeup_latency", samples, count);
+	free(samples);
+
+	return result;
+}
+
+/* time from an empty commit until its reload was latched */
+static int bench_commit_latency(int fd, unsigned int iterations)
+{
+	cdc_commit commit;
+	long long *samples;
+	long long start;
+	unsigned int i;
+	int result = 0;
+
+	samples = calloc(iterations, sizeof(*samples));
+	if(!samples)
+		return -ENOMEM;
+
+	for(i = 0; i < iterations; i++)
+	{
+		memset(&commit, 0, sizeof(commit));
+		commit.flags = CDC_COMMIT_FLAG_WAIT;
+		commit.in_fence = -1;
+		start = bench_now_ns();
+		if(ioctl(fd, CDC_IOCTL_COMMIT, &commit))
+		{
+			result = -errno;
+			break;
+		}
+		samples[i] = bench_now_ns() - start;
+	}
+
+	if(!result)
+		bench_distribution("commit_reload_latency", samples, iterations);
+	free(samples);
+
+	return result;
+}
+
+/* frame pacing: vblank periods as seen by the IRQ and by the waiter */
+static int bench_frame_pacing(int fd, unsigned int iterations)
+{
+	cdc_vblank_wait wait;
+	long long *irq_period, *wake_period, *wake_delay;
+	long long last_irq = 0, last_wake = 0, now;
+	unsigned int i, count = 0;
+	int result = 0;
+
+	irq_period = calloc(iterations, sizeof(*irq_period));
+	wake_period = calloc(iterations, sizeof(*wake_period));
+	wake_delay = calloc(iterations, sizeof(*wake_delay));
+	if(!irq_period || !wake_period || !wake_delay)
+	{
+		result = -ENOMEM;
+		goto OUT;
+	}
+
+	for(i = 0; i <= iterations; i++)
+	{
+		memset(&wait, 0, sizeof(wait));
+		wait.flags = CDC_VBLANK_RELATIVE;
+		wait.sequence = 1;
+		wait.timeout_ms = 1000;
+		if(ioctl(fd, CDC_IOCTL_WAIT_VBLANK, &wait))
+		{
+			result = -errno;
+			goto OUT;
+		}
+		now = bench_now_ns();
+
+		/* the first wait only establishes the reference */
+		if(i)
+		{
+			irq_period[count] = wait.timestamp - last_irq;
+			wake_period[count] = now - last_wake;
+			wake_delay[count] = now - wait.timestamp;
+			count++;
+		}
+		last_irq = wait.timestamp;
+		last_wake = now;
+	}
+
+	bench_distribution("vblank_period_irq", irq_period, count);
+	bench_distribution("vblank_period_wakeup", wake_period, count);
+	bench_distribution("vblank_wakeup_latency", wake_delay, count);
+
+OUT:
+	free(irq_period);
+	free(wake_period);
+	free(wake_delay);
+
+	return result;
+}
+
+static const bench_test bench_tests[] = {
+	{ "reg_write", bench_reg_write },
+	{ "reg_read", bench_reg_read },
+	{ "irq_latency", bench_irq_latency },
+	{ "commit_latency", bench_commit_latency },
+	{ "frame_pacing", bench_frame_pacing },
+};
+
+#define BENCH_TEST_COUNT (sizeof(bench_tests) / sizeof(bench_tests[0]))
+
+static void bench_usage(const char *prog)
+{
+	unsigned int i;
+
+	fprintf(stderr, "usage: %s [-d device] [-n iterations] [-f frames] "
+			"[test...]\n  tests:", prog);
+	for(i = 0; i < BENCH_TEST_COUNT; i++)
+		fprintf(stderr, " %s", bench_tests[i].name);
+	fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *device = "/dev/cdc0";
+	unsigned int iterations = 100000, frames = 300;
+	unsigned int i, selected = 0, failed = 0;
+	int opt, fd, result, t;
+
+	while((opt = getopt(argc, argv, "d:n:f:h")) != -1)
+	{
+		switch(opt)
+		{
+			case 'd':
+				device = optarg;
+				break;
+			case 'n':
+				iterations = strtoul(optarg, NULL, 0);
+				break;
+			case 'f':
+				frames = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				bench_usage(argv[0]);
+				return 2;
+		}
+	}
+
+	if(!iterations || !frames || frames > BENCH_MAX_SAMPLES)
+	{
+		bench_usage(argv[0]);
+		return 2;
+	}
+
+	for(i = optind; i < (unsigned int) argc; i++)
+	{
+		for(t = 0; t < (int) BENCH_TEST_COUNT; t++)
+		{
+			if(!strcmp(argv[i], bench_tests[t].name))
+				break;
+		}
+		if(t == (int) BENCH_TEST_COUNT)
+		{
+			bench_usage(argv[0]);
+			return 2;
+		}
+		selected |= 1u << t;
+	}
+	if(!selected)
+		selected = (1u << BENCH_TEST_COUNT) - 1;
+
+	fd = open(device, O_RDWR);
+	if(fd < 0)
+	{
+		perror(device);
+		return 1;
+	}
+
+	printf("{\n  \"format\": 1,\n  \"device\": \"%s\",\n"
+			"  \"iterations\": %u,\n  \"frames\": %u,\n  \"results\": [",
+			device, iterations, frames);
+
+	for(t = 0; t < (int) BENCH_TEST_COUNT; t++)
+	{
+		if(!(selected & (1u << t)))
+			continue;
+
+		/* latency tests run per frame, not per IOCTL */
+		result = bench_tests[t].run(fd, t < 2 ? iterations : frames);
+		if(result)
+		{
+			fprintf(stderr, "%s: %s\n", bench_tests[t].name,
+					strerror(-result));
+			failed++;
+		}
+	}
+
+	printf("\n  ]\n}\n");
+	close(fd);
+
+	return failed ? 1 : 0;
+}
@@ -80,6 +80,10 @@
 #define CDC_REG_GLOBAL_CONTROL_GAMMA_ENABLE     0x00000002u
 #define CDC_REG_GLOBAL_CONTROL_ENABLE           0x00000001u
 
+// Shadow reload bits
+#define CDC_REG_GLOBAL_SHADOW_RELOAD_IMMEDIATE  0x00000001u
+#define CDC_REG_GLOBAL_SHADOW_RELOAD_VBLANK     0x00000002u
+
 // Layer span
 #define CDC_LAYER_SPAN 0x40
 
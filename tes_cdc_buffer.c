@@ -0,0 +1,533 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/uaccess.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/overflow.h>
+#include "tes_cdc_module.h"
+#include "tes_cdc_driver.h"
+#include "cdc_base.h"
+
+/* Scanout buffers, either imported dma-bufs or allocated by the driver.
+ * Every buffer is referenced by its handle, by each layer slot that scans it
+ * out and by each mapping, so a buffer released by its owner stays alive
+ * until the commit that replaced it was latched. */
+
+static const unsigned int cdc_scanout_regs[CDC_SCANOUT_SLOTS] = {
+	CDC_REG_LAYER_FB_START,
+	CDC_REG_LAYER_AUX0_FB_START,
+	CDC_REG_LAYER_AUX1_FB_START,
+};
+
+static unsigned int pool_size_kb = CDC_BUFFER_POOL_KB;
+module_param(pool_size_kb, uint, 0644);
+MODULE_PARM_DESC(pool_size_kb,
+		"Maximum size of freed scanout buffers kept for reuse in KiB");
+
+/* Allocated buffers go back to a free pool when their last reference is
+ * dropped. A new allocation of the same (page aligned) size, e.g. after
+ * switching modes back and forth, is then served without waiting for CMA.
+ * The pool is limited to pool_size_kb, the oldest entries are freed first. */
+static void cdc_pool_free(struct cdc_dev *dev, struct cdc_buffer *buf)
+{
+	dma_free_wc(dev->dma_dev, buf->size, buf->vaddr, buf->addr);
+	kfree(buf);
+}
+
+/* called with pool_lock held */
+static void cdc_pool_trim(struct cdc_dev *dev, size_t limit)
+{
+	struct cdc_buffer *buf;
+
+	while(dev->pool_size > limit)
+	{
+		buf = list_last_entry(&dev->pool, struct cdc_buffer, pool_node);
+		list_del(&buf->pool_node);
+		dev->pool_size -= buf->size;
+		cdc_pool_free(dev, buf);
+	}
+}
+
+static void cdc_pool_put(struct cdc_dev *dev, struct cdc_buffer *buf)
+{
+	size_t limit = (size_t) pool_size_kb << 10;
+
+	if(buf->size > limit)
+	{
+		cdc_pool_free(dev, buf);
+		return;
+	}
+
+	mutex_lock(&dev->pool_lock);
+	list_add(&buf->pool_node, &dev->pool);
+	dev->pool_size += buf->size;
+	cdc_pool_trim(dev, limit);
+	mutex_unlock(&dev->pool_lock);
+}
+
+static struct cdc_buffer *cdc_pool_get(struct cdc_dev *dev, size_t size)
+{
+	struct cdc_buffer *buf;
+
+	mutex_lock(&dev->pool_lock);
+	list_for_each_entry(buf, &dev->pool, pool_node)
+	{
+		if(buf->size == size)
+		{
+			list_del(&buf->pool_node);
+			dev->pool_size -= size;
+			mutex_unlock(&dev->pool_lock);
+
+			/* do not hand out the contents of a previous user */
+			memset(buf->vaddr, 0, size);
+			return buf;
+		}
+	}
+	mutex_unlock(&dev->pool_lock);
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if(!buf)
+		return NULL;
+	buf->size = size;
+
+	buf->vaddr = dma_alloc_wc(dev->dma_dev, size, &buf->addr,
+			GFP_KERNEL | __GFP_NOWARN);
+	if(!buf->vaddr)
+	{
+		/* pooled buffers of other sizes may be in the way */
+		mutex_lock(&dev->pool_lock);
+		cdc_pool_trim(dev, 0);
+		mutex_unlock(&dev->pool_lock);
+
+		buf->vaddr = dma_alloc_wc(dev->dma_dev, size, &buf->addr,
+				GFP_KERNEL);
+	}
+
+	if(!buf->vaddr)
+	{
+		kfree(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+static void cdc_buffer_free(struct kref *ref)
+{
+	struct cdc_buffer *buf = container_of(ref, struct cdc_buffer, ref);
+
+	if(!buf->dmabuf)
+	{
+		cdc_pool_put(buf->dev, buf);
+		return;
+	}
+
+	dma_buf_unmap_attachment(buf->attach, buf->sgt, DMA_TO_DEVICE);
+	dma_buf_detach(buf->dmabuf, buf->attach);
+	dma_buf_put(buf->dmabuf);
+	kfree(buf);
+}
+
+static void cdc_buffer_put(struct cdc_buffer *buf)
+{
+	if(buf)
+		kref_put(&buf->ref, cdc_buffer_free);
+}
+
+/* the CDC fetches linearly, so the mapping must be one contiguous range */
+static int cdc_buffer_contiguous(struct sg_table *sgt, dma_addr_t *addr,
+		size_t *size)
+{
+	struct scatterlist *sg;
+	dma_addr_t next;
+	unsigned int i;
+
+	*addr = sg_dma_address(sgt->sgl);
+	next = *addr;
+	for_each_sg(sgt->sgl, sg, sgt->nents, i)
+	{
+		if(sg_dma_address(sg) != next)
+			return 0;
+		next += sg_dma_len(sg);
+	}
+	*size = next - *addr;
+
+	return 1;
+}
+
+/* hand out a handle of the file for a new buffer */
+static int cdc_buffer_add(struct cdc_file *cf, struct cdc_buffer *buf)
+{
+	struct cdc_dev *dev = cf->dev;
+	int handle;
+
+	kref_init(&buf->ref);
+	buf->dev = dev;
+	buf->owner = cf;
+
+	mutex_lock(&dev->buffer_lock);
+	handle = idr_alloc(&dev->buffers, buf, 1, CDC_BUFFER_HANDLE_END,
+			GFP_KERNEL);
+	if(handle >= 0)
+	{
+		buf->handle = handle;
+		list_add(&buf->file_node, &cf->buffers);
+	}
+	mutex_unlock(&dev->buffer_lock);
+	if(handle < 0)
+		return handle;
+
+	return 0;
+}
+
+long cdc_ioctl_buffer_import(struct cdc_file *cf, void __user *arg)
+{
+	struct cdc_dev *dev = cf->dev;
+	cdc_buffer_import import;
+	struct cdc_buffer *buf;
+	long result;
+
+	if(copy_from_user(&import, arg, sizeof(import)))
+		return -EFAULT;
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if(!buf)
+		return -ENOMEM;
+
+	buf->dmabuf = dma_buf_get(import.fd);
+	if(IS_ERR(buf->dmabuf))
+	{
+		result = PTR_ERR(buf->dmabuf);
+		goto GET_FAILED;
+	}
+
+	buf->attach = dma_buf_attach(buf->dmabuf, dev->dma_dev);
+	if(IS_ERR(buf->attach))
+	{
+		result = PTR_ERR(buf->attach);
+		goto ATTACH_FAILED;
+	}
+
+	buf->sgt = dma_buf_map_attachment(buf->attach, DMA_TO_DEVICE);
+	if(IS_ERR(buf->sgt))
+	{
+		result = PTR_ERR(buf->sgt);
+		goto MAP_FAILED;
+	}
+
+	if(!cdc_buffer_contiguous(buf->sgt, &buf->addr, &buf->size))
+	{
+		dev_dbg(dev->device, "dma-buf %d is not contiguous\n", import.fd);
+		result = -EINVAL;
+		goto CONTIG_FAILED;
+	}
+
+	result = cdc_buffer_add(cf, buf);
+	if(result)
+		goto CONTIG_FAILED;
+
+	import.handle = buf->handle;
+	import.addr = buf->addr;
+	import.size = buf->size;
+	if(copy_to_user(arg, &import, sizeof(import)))
+	{
+		cdc_ioctl_buffer_release(cf, import.handle);
+		return -EFAULT;
+	}
+
+	return 0;
+
+CONTIG_FAILED:
+	dma_buf_unmap_attachment(buf->attach, buf->sgt, DMA_TO_DEVICE);
+MAP_FAILED:
+	dma_buf_detach(buf->dmabuf, buf->attach);
+ATTACH_FAILED:
+	dma_buf_put(buf->dmabuf);
+GET_FAILED:
+	kfree(buf);
+
+	return result;
+}
+
+long cdc_ioctl_buffer_alloc(struct cdc_file *cf, void __user *arg)
+{
+	struct cdc_dev *dev = cf->dev;
+	cdc_buffer_alloc alloc;
+	struct cdc_buffer *buf;
+	size_t size;
+	long result;
+
+	if(copy_from_user(&alloc, arg, sizeof(alloc)))
+		return -EFAULT;
+
+	/* sizes are limited by the 16 bit window registers */
+	if(!alloc.width || alloc.width > U16_MAX ||
+			!alloc.height || alloc.height > U16_MAX ||
+			alloc.format >= ARRAY_SIZE(cdc_formats_bpp))
+		return -EINVAL;
+
+	alloc.pitch = ALIGN(alloc.width * cdc_formats_bpp[alloc.format],
+			CDC_BUFFER_PITCH_ALIGN);
+	/* checked before page alignment, which could wrap to 0 */
+	if(check_mul_overflow((size_t) alloc.pitch, (size_t) alloc.height,
+			&size) || size > CDC_BUFFER_SIZE_MAX)
+		return -EINVAL;
+	size = PAGE_ALIGN(size);
+
+	buf = cdc_pool_get(dev, size);
+	if(!buf)
+		return -ENOMEM;
+
+	result = cdc_buffer_add(cf, buf);
+	if(result)
+	{
+		cdc_pool_put(dev, buf);
+		return result;
+	}
+
+	alloc.handle = buf->handle;
+	alloc.addr = buf->addr;
+	alloc.size = buf->size;
+	alloc.offset = (u64) (CDC_MMAP_BUFFER_PGOFF + buf->handle) << PAGE_SHIFT;
+	if(copy_to_user(arg, &alloc, sizeof(alloc)))
+	{
+		cdc_ioctl_buffer_release(cf, alloc.handle);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+/* a mapping keeps its buffer from going back to the pool */
+static void cdc_buffer_vm_open(struct vm_area_struct *vma)
+{
+	struct cdc_buffer *buf = vma->vm_private_data;
+
+	kref_get(&buf->ref);
+}
+
+static void cdc_buffer_vm_close(struct vm_area_struct *vma)
+{
+	cdc_buffer_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct cdc_buffer_vm_ops = {
+	.open = cdc_buffer_vm_open,
+	.close = cdc_buffer_vm_close,
+};
+
+/* write-combined mapping of an allocated buffer of this file */
+int cdc_buffer_mmap(struct cdc_file *cf, struct vm_area_struct *vma)
+{
+	struct cdc_dev *dev = cf->dev;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	struct cdc_buffer *buf;
+	int result;
+
+	mutex_lock(&dev->buffer_lock);
+	buf = idr_find(&dev->buffers, vma->vm_pgoff - CDC_MMAP_BUFFER_PGOFF);
+	if(!buf || buf->owner != cf || buf->dmabuf)
+	{
+		mutex_unlock(&dev->buffer_lock);
+		return -EINVAL;
+	}
+	kref_get(&buf->ref);
+	mutex_unlock(&dev->buffer_lock);
+
+	if(size > buf->size)
+	{
+		result = -EINVAL;
+		goto FAILED;
+	}
+
+	/* the page offset selected the buffer, it maps from its start */
+	vma->vm_pgoff = 0;
+	result = dma_mmap_wc(dev->dma_dev, vma, buf->vaddr, buf->addr,
+			buf->size);
+	if(result)
+		goto FAILED;
+
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_private_data = buf;
+	vma->vm_ops = &cdc_buffer_vm_ops;
+
+	return 0;
+
+FAILED:
+	cdc_buffer_put(buf);
+
+	return result;
+}
+
+long cdc_ioctl_buffer_release(struct cdc_file *cf, unsigned int handle)
+{
+	struct cdc_dev *dev = cf->dev;
+	struct cdc_buffer *buf;
+
+	mutex_lock(&dev->buffer_lock);
+	buf = idr_find(&dev->buffers, handle);
+	if(!buf || buf->owner != cf)
+	{
+		mutex_unlock(&dev->buffer_lock);
+		return -EINVAL;
+	}
+	idr_remove(&dev->buffers, handle);
+	list_del(&buf->file_node);
+	mutex_unlock(&dev->buffer_lock);
+
+	cdc_buffer_put(buf);
+
+	return 0;
+}
+
+/* drop all handles of a file that is closed */
+void cdc_buffer_release_file(struct cdc_file *cf)
+{
+	struct cdc_dev *dev = cf->dev;
+	struct cdc_buffer *buf, *tmp;
+
+	mutex_lock(&dev->buffer_lock);
+	list_for_each_entry_safe(buf, tmp, &cf->buffers, file_node)
+	{
+		idr_remove(&dev->buffers, buf->handle);
+		list_del(&buf->file_node);
+		cdc_buffer_put(buf);
+	}
+	mutex_unlock(&dev->buffer_lock);
+}
+
+/* buffer of the file containing a bus address, with a new reference. Only
+ * the committing file's handles pin, a buffer of another file is treated
+ * like memory managed by the application. */
+static struct cdc_buffer *cdc_buffer_lookup(struct cdc_file *cf, u32 addr)
+{
+	struct cdc_buffer *buf;
+
+	list_for_each_entry(buf, &cf->buffers, file_node)
+	{
+		if(addr >= buf->addr && addr - buf->addr < buf->size)
+		{
+			kref_get(&buf->ref);
+			return buf;
+		}
+	}
+
+	return NULL;
+}
+
+/* collect the buffers the framebuffer addresses of a commit point to.
+ * Addresses outside of the file's buffers are still accepted (memory
+ * managed by the application), their slot just does not pin anything. */
+int cdc_buffer_pin_commit(struct cdc_file *cf, const cdc_commit_layer *layers,
+		unsigned int count, struct cdc_buffer_pins **pins)
+{
+	struct cdc_dev *dev = cf->dev;
+	struct cdc_buffer_pins *p;
+	unsigned int i, s, n = 0;
+
+	for(i = 0; i < count; i++)
+	{
+		for(s = 0; s < CDC_SCANOUT_SLOTS; s++)
+		{
+			if(layers[i].mask & (1u << cdc_scanout_regs[s]))
+				n++;
+		}
+	}
+
+	*pins = NULL;
+	if(!n)
+		return 0;
+
+	p = kzalloc(sizeof(*p) + n * sizeof(p->pin[0]), GFP_KERNEL);
+	if(!p)
+		return -ENOMEM;
+
+	mutex_lock(&dev->buffer_lock);
+	for(i = 0; i < count; i++)
+	{
+		for(s = 0; s < CDC_SCANOUT_SLOTS; s++)
+		{
+			if(!(layers[i].mask & (1u << cdc_scanout_regs[s])))
+				continue;
+
+			p->pin[p->count].slot = layers[i].layer * CDC_SCANOUT_SLOTS + s;
+			p->pin[p->count].buffer = cdc_buffer_lookup(cf,
+					layers[i].regs[cdc_scanout_regs[s]]);
+			p->count++;
+		}
+	}
+	mutex_unlock(&dev->buffer_lock);
+
+	*pins = p;
+
+	return 0;
+}
+
+/* the commit was written: its buffers are scanned out from now on and the
+ * pins take over the buffers they replaced */
+void cdc_buffer_scanout(struct cdc_dev *dev, struct cdc_buffer_pins *pins)
+{
+	struct cdc_buffer *old;
+	unsigned int i;
+
+	if(!pins)
+		return;
+
+	for(i = 0; i < pins->count; i++)
+	{
+		old = dev->scanout[pins->pin[i].slot];
+		dev->scanout[pins->pin[i].slot] = pins->pin[i].buffer;
+		pins->pin[i].buffer = old;
+	}
+}
+
+void cdc_buffer_unpin(struct cdc_buffer_pins *pins)
+{
+	unsigned int i;
+
+	if(!pins)
+		return;
+
+	for(i = 0; i < pins->count; i++)
+		cdc_buffer_put(pins->pin[i].buffer);
+	kfree(pins);
+}
+
+int cdc_buffer_init(struct cdc_dev *dev)
+{
+	mutex_init(&dev->buffer_lock);
+	idr_init(&dev->buffers);
+	mutex_init(&dev->pool_lock);
+	INIT_LIST_HEAD(&dev->pool);
+
+	dev->scanout = kcalloc(dev->layer_count * CDC_SCANOUT_SLOTS,
+			sizeof(*dev->scanout), GFP_KERNEL);
+	if(!dev->scanout)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void cdc_buffer_exit(struct cdc_dev *dev)
+{
+	struct cdc_buffer *buf;
+	unsigned int i;
+	int id;
+
+	for(i = 0; i < dev->layer_count * CDC_SCANOUT_SLOTS; i++)
+		cdc_buffer_put(dev->scanout[i]);
+	kfree(dev->scanout);
+
+	idr_for_each_entry(&dev->buffers, buf, id)
+		cdc_buffer_put(buf);
+	idr_destroy(&dev->buffers);
+
+	mutex_lock(&dev->pool_lock);
+	cdc_pool_trim(dev, 0);
+	mutex_unlock(&dev->pool_lock);
+}
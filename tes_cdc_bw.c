@@ -0,0 +1,226 @@
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/math64.h>
+#include <asm/io.h>
+#include "tes_cdc_module.h"
+#include "tes_cdc_driver.h"
+#include "cdc_base.h"
+
+/* Memory bandwidth model. Per layer, the bytes fetched per line and the
+ * number of fetched lines are taken from the framebuffer registers (which
+ * already account for pitch, duplication and scaling); if they are not
+ * programmed yet, the window size, cdc_formats_bpp and duplication are
+ * used instead. The average rate spreads a frame over the total frame time,
+ * the peak rate fetches a line while the layer window of that line is
+ * scanned out. */
+
+/* layer registers the model depends on */
+#define CDC_BW_LAYER_REGS ((1u << CDC_REG_LAYER_CONTROL) | \
+		(1u << CDC_REG_LAYER_WINDOW_H) | \
+		(1u << CDC_REG_LAYER_WINDOW_V) | \
+		(1u << CDC_REG_LAYER_PIXEL_FORMAT) | \
+		(1u << CDC_REG_LAYER_AUX_FB_CONTROL) | \
+		(1u << CDC_REG_LAYER_FB_LENGTH) | \
+		(1u << CDC_REG_LAYER_FB_LINES) | \
+		(1u << CDC_REG_LAYER_AUX_FB_LENGTH) | \
+		(1u << CDC_REG_LAYER_AUX_FB_LINES))
+
+/* aux framebuffer in use (alpha plane or YCbCr conversion) */
+#define CDC_BW_AUX_FB_ON 0x00000009u
+
+/* window registers hold start and stop (inclusive) as two 16 bit fields */
+static u32 cdc_bw_span(u32 window)
+{
+	u32 start = window & 0xffff;
+	u32 stop = window >> 16;
+
+	return stop >= start ? stop - start + 1 : 0;
+}
+
+static void cdc_bw_layer(const u32 *regs, u32 pixel_clock_khz,
+		u64 frame_pixels, cdc_bw_usage *usage)
+{
+	u32 control = regs[CDC_REG_LAYER_CONTROL];
+	u32 width, height, line_bytes, lines;
+	u64 pixel_clock, rate, rem;
+
+	memset(usage, 0, sizeof(*usage));
+	if(!(control & CDC_REG_LAYER_CONTROL_ENABLE))
+		return;
+
+	width = cdc_bw_span(regs[CDC_REG_LAYER_WINDOW_H]);
+	height = cdc_bw_span(regs[CDC_REG_LAYER_WINDOW_V]);
+	if(!width || !height)
+		return;
+
+	line_bytes = regs[CDC_REG_LAYER_FB_LENGTH] & 0xffff;
+	if(!line_bytes)
+	{
+		line_bytes = width *
+			cdc_formats_bpp[regs[CDC_REG_LAYER_PIXEL_FORMAT] & 0x7];
+		if(control & CDC_REG_LAYER_CONTROL_H_DUPLICATION)
+			line_bytes = DIV_ROUND_UP(line_bytes, 2);
+	}
+
+	lines = regs[CDC_REG_LAYER_FB_LINES] & 0xffff;
+	if(!lines)
+	{
+		lines = height;
+		if(control & CDC_REG_LAYER_CONTROL_V_DUPLICATION)
+			lines = DIV_ROUND_UP(lines, 2);
+	}
+
+	usage->frame_bytes = (u64) line_bytes * lines;
+
+	if(regs[CDC_REG_LAYER_AUX_FB_CONTROL] & CDC_BW_AUX_FB_ON)
+	{
+		line_bytes += regs[CDC_REG_LAYER_AUX_FB_LENGTH] & 0xffff;
+		usage->frame_bytes +=
+			(u64) (regs[CDC_REG_LAYER_AUX_FB_LENGTH] & 0xffff) *
+			(regs[CDC_REG_LAYER_AUX_FB_LINES] & 0xffff);
+	}
+
+	if(!pixel_clock_khz || !frame_pixels)
+		return;
+
+	/* frame_bytes has up to 33 bits, with the pixel clock in Hz the
+	 * product would come close to 64 bits. The rate is taken in kHz and
+	 * the remainder scaled on its own. */
+	rate = div64_u64_rem(usage->frame_bytes * pixel_clock_khz, frame_pixels,
+			&rem);
+	usage->average = rate * 1000 + div64_u64(rem * 1000, frame_pixels);
+
+	pixel_clock = (u64) pixel_clock_khz * 1000;
+	usage->peak = div_u64((u64) line_bytes * pixel_clock, width);
+}
+
+/* estimate the configuration with the given layer updates applied, called
+ * with commit_lock held */
+void cdc_bw_estimate(struct cdc_dev *dev, const cdc_commit_layer *layers,
+		unsigned int count, cdc_bandwidth *bw)
+{
+	u32 regs[CDC_COMMIT_LAYER_REGS];
+	cdc_bw_usage usage;
+	u32 total_width;
+	u64 frame_pixels;
+	unsigned int l, i, r;
+
+	/* total width/height are stored minus one */
+	total_width = cdc_reg_read_single(dev, CDC_REG_GLOBAL_TOTAL_WIDTH);
+	frame_pixels = (u64) ((total_width >> 16) + 1) *
+		((total_width & 0xffff) + 1);
+
+	memset(&bw->total, 0, sizeof(bw->total));
+	memset(bw->layer, 0, sizeof(bw->layer));
+	bw->pixel_clock_khz = dev->pixel_clock_khz;
+	bw->budget = dev->bw_budget;
+	bw->layer_count = min(dev->layer_count, CDC_BW_LAYERS_MAX);
+
+	for(l = 0; l < dev->layer_count; l++)
+	{
+		for(r = 0; r < CDC_COMMIT_LAYER_REGS; r++)
+		{
+			if(CDC_BW_LAYER_REGS & (1u << r))
+				regs[r] = cdc_reg_read_single(dev, CDC_LAYER_REG(l, r));
+		}
+
+		/* later updates of the same layer win, as in a commit */
+		for(i = 0; i < count; i++)
+		{
+			if(layers[i].layer != l)
+				continue;
+			for(r = 0; r < CDC_COMMIT_LAYER_REGS; r++)
+			{
+				if(layers[i].mask & (1u << r))
+					regs[r] = layers[i].regs[r];
+			}
+		}
+
+		cdc_bw_layer(regs, dev->pixel_clock_khz, frame_pixels, &usage);
+		if(l < CDC_BW_LAYERS_MAX)
+			bw->layer[l] = usage;
+
+		bw->total.frame_bytes += usage.frame_bytes;
+		bw->total.average += usage.average;
+		bw->total.peak += usage.peak;
+	}
+}
+
+/* admission control for a commit, called with commit_lock held */
+int cdc_bw_admit(struct cdc_dev *dev, const cdc_commit_layer *layers,
+		unsigned int count)
+{
+	cdc_bandwidth bw;
+
+	if(!dev->bw_budget || !dev->pixel_clock_khz)
+		return 0;
+
+	cdc_bw_estimate(dev, layers, count, &bw);
+	if(bw.total.peak > dev->bw_budget)
+	{
+		dev_dbg(dev->device, "commit exceeds bus budget (%llu > %llu)\n",
+				bw.total.peak, dev->bw_budget);
+		return -ENOSPC;
+	}
+
+	return 0;
+}
+
+long cdc_ioctl_bandwidth(struct cdc_dev *dev, void __user *arg)
+{
+	cdc_bandwidth bw;
+	cdc_commit_layer *layers = NULL;
+	long result = 0;
+
+	if(copy_from_user(&bw, arg, sizeof(bw)))
+		return -EFAULT;
+
+	if(bw.count > dev->layer_count)
+		return -EINVAL;
+
+	if(bw.count)
+	{
+		layers = memdup_user((void __user *) bw.layers,
+				bw.count * sizeof(*layers));
+		if(IS_ERR(layers))
+			return PTR_ERR(layers);
+
+		if(!cdc_commit_layers_valid(dev, layers, bw.count))
+		{
+			result = -EINVAL;
+			goto FAILED;
+		}
+	}
+
+	mutex_lock(&dev->commit_lock);
+	cdc_bw_estimate(dev, layers, bw.count, &bw);
+	mutex_unlock(&dev->commit_lock);
+
+	if(copy_to_user(arg, &bw, sizeof(bw)))
+		result = -EFAULT;
+
+FAILED:
+	kfree(layers);
+
+	return result;
+}
+
+long cdc_ioctl_bw_config(struct cdc_dev *dev, void __user *arg)
+{
+	cdc_bw_config config;
+
+	if(copy_from_user(&config, arg, sizeof(config)))
+		return -EFAULT;
+
+	if(config.pixel_clock_khz > CDC_PIXEL_CLOCK_MAX_KHZ)
+		return -EINVAL;
+
+	mutex_lock(&dev->commit_lock);
+	dev->pixel_clock_khz = config.pixel_clock_khz;
+	dev->bw_budget = config.budget;
+	mutex_unlock(&dev->commit_lock);
+
+	return 0;
+}
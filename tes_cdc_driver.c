@@ -16,35 +16,857 @@
 #include <linux/of_irq.h>
 #include <linux/platform_device.h>
 #include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/dma-fence.h>
+#include <linux/sync_file.h>
+#include <linux/file.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/poll.h>
+#include <linux/dma-mapping.h>
+#include <linux/math64.h>
 #include <asm/io.h>
 #include <asm/uaccess.h>
 #include "tes_cdc_module.h"
 #include "tes_cdc_driver.h"
 #include "cdc_base.h"
 
-/* store class globally. So far, this module does not fully support multiple
- * cdc instances but still... */
-struct class *cdc_class;
+#define CREATE_TRACE_POINTS
+#include "tes_cdc_trace.h"
+
+/* class and character device region are shared by all CDC instances and
+ * created at module init, every instance gets its own minor */
+static struct class *cdc_class;
+static dev_t cdc_devt;
+static DEFINE_IDA(cdc_minors);
 
 /* fops functions */
 static int cdc_open(struct inode *ip, struct file *fp)
 {
-	struct cdc_dev *dev;
+	struct cdc_file *cf;
+
+	cf = kzalloc(sizeof(*cf), GFP_KERNEL);
+	if(!cf)
+		return -ENOMEM;
+
+	/* extract the device structure and add it to the per file session for
+	 * easier access */
+	cf->dev = container_of(ip->i_cdev, struct cdc_dev, cdev);
+	cf->event_tail = atomic64_read(&cf->dev->event_head);
+	mutex_init(&cf->txn_lock);
+	INIT_LIST_HEAD(&cf->buffers);
+	fp->private_data = cf;
+
+	return 0;
+}
+
+static int cdc_release(struct inode *ip, struct file *fp)
+{
+	struct cdc_file *cf = fp->private_data;
+
+	cdc_irq_put(cf->dev, cf->irq_mask);
+	cdc_buffer_release_file(cf);
+	kfree(cf->txn);
+	kfree(cf);
+
+	return 0;
+}
+
+/* register indices are word offsets into the mapped register window */
+static inline int cdc_reg_valid(struct cdc_dev *dev, unsigned long reg)
+{
+	return reg <= (dev->span >> 2);
+}
+
+/* The line IRQ is off while nobody needs it. When it is enabled again, the
+ * vblanks in between are added from the frame period: the timing with the
+ * configured pixel clock or else the measured period. Called with reg_slck
+ * held. */
+static void cdc_vblank_catch_up(struct cdc_dev *dev)
+{
+	s64 period = 0, elapsed;
+	u32 total;
+	u64 frames;
+
+	if(dev->pixel_clock_khz)
+	{
+		total = cdc_reg_read(dev, CDC_REG_GLOBAL_TOTAL_WIDTH);
+		period = div_u64((u64) ((total >> 16) + 1) * ((total & 0xffff) + 1) *
+				1000000, dev->pixel_clock_khz);
+	}
+
+	spin_lock(&dev->irq_slck);
+	if(!period)
+		period = dev->vblank_period;
+	elapsed = ktime_to_ns(ktime_sub(ktime_get(), dev->vblank_time));
+	if(period > 0 && dev->vblank_seq && elapsed > 0)
+	{
+		/* to the nearest vblank, the next line IRQ corrects an estimate
+		 * that was early */
+		frames = div64_u64(elapsed + period / 2, period);
+		dev->vblank_seq += frames;
+		dev->vblank_time = ktime_add_ns(dev->vblank_time, frames * period);
+	}
+	/* the next line IRQ does not follow the last one */
+	dev->vblank_estimated = true;
+	spin_unlock(&dev->irq_slck);
+}
+
+/* The driver owns CDC_REG_GLOBAL_IRQ_ENABLE: every CDC_IRQ_* type is
+ * reference counted and only enabled while a file subscribed to it or an
+ * in-kernel user (commit, vblank waiter, ...) needs it. */
+static void cdc_irq_update(struct cdc_dev *dev)
+{
+	unsigned int enable = 0;
+	unsigned int i;
+
+	lockdep_assert_held(&dev->reg_slck);
+
+	for(i = 0; i < CDC_IRQ_TYPES; i++)
+	{
+		if(dev->irq_refs[i])
+			enable |= 1u << i;
+	}
+
+	if(enable & ~dev->irq_enabled & CDC_IRQ_LINE)
+		cdc_vblank_catch_up(dev);
+
+	if(enable != dev->irq_enabled)
+	{
+		cdc_reg_write(dev, CDC_REG_GLOBAL_IRQ_ENABLE, enable);
+		dev->irq_enabled = enable;
+	}
+}
+
+void cdc_irq_get(struct cdc_dev *dev, unsigned int mask)
+{
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&dev->reg_slck, flags);
+	for(i = 0; i < CDC_IRQ_TYPES; i++)
+	{
+		if(mask & (1u << i))
+			dev->irq_refs[i]++;
+	}
+	cdc_irq_update(dev);
+	spin_unlock_irqrestore(&dev->reg_slck, flags);
+}
+
+void cdc_irq_put(struct cdc_dev *dev, unsigned int mask)
+{
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&dev->reg_slck, flags);
+	for(i = 0; i < CDC_IRQ_TYPES; i++)
+	{
+		if((mask & (1u << i)) && !WARN_ON(!dev->irq_refs[i]))
+			dev->irq_refs[i]--;
+	}
+	cdc_irq_update(dev);
+	spin_unlock_irqrestore(&dev->reg_slck, flags);
+}
+
+/* change the IRQ subscription of a session */
+static void cdc_file_set_irq_mask(struct cdc_file *cf, unsigned int mask)
+{
+	mask &= CDC_IRQ_MASK_ALL;
+	if(mask == cf->irq_mask)
+		return;
+
+	cdc_irq_get(cf->dev, mask);
+	cdc_irq_put(cf->dev, cf->irq_mask);
+	cf->irq_mask = mask;
+}
+
+/* write a validated list of registers. The device lock keeps batches and
+ * transactions of different sessions from interleaving. */
+static void cdc_apply_writes(struct cdc_dev *dev, const cdc_reg_pair *pairs,
+		unsigned int count)
+{
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&dev->lut_slck, flags);
+	spin_lock(&dev->reg_slck);
+	for(i = 0; i < count; i++)
+		cdc_reg_write(dev, pairs[i].reg, pairs[i].value);
+	spin_unlock(&dev->reg_slck);
+
+	cdc_lut_snoop(dev, pairs, count);
+	spin_unlock_irqrestore(&dev->lut_slck, flags);
+}
+
+/* queue validated writes in the open transaction of a session */
+static long cdc_txn_append(struct cdc_file *cf, const cdc_reg_pair *pairs,
+		unsigned int count)
+{
+	cdc_reg_pair *txn;
+	unsigned int size;
+
+	if(cf->txn_count + count > CDC_REG_BATCH_MAX)
+		return -ENOSPC;
+
+	if(cf->txn_count + count > cf->txn_size)
+	{
+		size = max(cf->txn_size * 2, CDC_REG_BATCH_STACK);
+		while(size < cf->txn_count + count)
+			size *= 2;
+		size = min(size, CDC_REG_BATCH_MAX);
+
+		txn = krealloc(cf->txn, size * sizeof(*txn), GFP_KERNEL);
+		if(!txn)
+			return -ENOMEM;
+		cf->txn = txn;
+		cf->txn_size = size;
+	}
+
+	memcpy(&cf->txn[cf->txn_count], pairs, count * sizeof(*pairs));
+	cf->txn_count += count;
+
+	return 0;
+}
+
+/* write registers now, or queue them if the session has a transaction open.
+ * Writes to the IRQ enable register change the IRQ subscription of the
+ * session instead (immediately, also within a transaction). */
+static long cdc_session_write(struct cdc_file *cf, cdc_reg_pair *pairs,
+		unsigned int count)
+{
+	unsigned int i, n;
+	long result = 0;
+
+	mutex_lock(&cf->txn_lock);
+	for(i = 0, n = 0; i < count; i++)
+	{
+		if(pairs[i].reg == CDC_REG_GLOBAL_IRQ_ENABLE)
+			cdc_file_set_irq_mask(cf, pairs[i].value);
+		else
+			pairs[n++] = pairs[i];
+	}
+
+	if(cf->txn_open)
+		result = cdc_txn_append(cf, pairs, n);
+	else if(n)
+		cdc_apply_writes(cf->dev, pairs, n);
+	mutex_unlock(&cf->txn_lock);
+
+	return result;
+}
+
+/* transaction control: between begin and commit all register writes of the
+ * session are collected and then applied in one piece on commit */
+static long cdc_ioctl_txn(struct cdc_file *cf, unsigned int cmd_nr)
+{
+	long result = 0;
+
+	mutex_lock(&cf->txn_lock);
+	switch(cmd_nr)
+	{
+		case CDC_IOCTL_NR_TXN_BEGIN:
+			if(cf->txn_open)
+			{
+				result = -EBUSY;
+				break;
+			}
+			cf->txn_open = 1;
+			cf->txn_count = 0;
+			break;
+		case CDC_IOCTL_NR_TXN_COMMIT:
+		case CDC_IOCTL_NR_TXN_ABORT:
+			if(!cf->txn_open)
+			{
+				result = -EINVAL;
+				break;
+			}
+			if(cmd_nr == CDC_IOCTL_NR_TXN_COMMIT)
+				cdc_apply_writes(cf->dev, cf->txn, cf->txn_count);
+			cf->txn_open = 0;
+			cf->txn_count = 0;
+			break;
+		default:
+			result = -EINVAL;
+	}
+	mutex_unlock(&cf->txn_lock);
+
+	return result;
+}
+
+/* batched register write: copy the whole list in, validate every index
+ * against the register window and only then touch the hardware */
+static long cdc_ioctl_write_batch(struct cdc_file *cf, void __user *arg)
+{
+	struct cdc_dev *dev = cf->dev;
+	cdc_reg_batch batch;
+	cdc_reg_pair stack_pairs[CDC_REG_BATCH_STACK];
+	cdc_reg_pair *pairs = stack_pairs;
+	unsigned int i;
+	long result = 0;
+
+	if(copy_from_user(&batch, arg, sizeof(batch)))
+		return -EFAULT;
+
+	if(!batch.count)
+		return 0;
+	if(batch.count > CDC_REG_BATCH_MAX)
+		return -EINVAL;
+
+	/* small batches (a layer update) stay off the allocator */
+	if(batch.count > CDC_REG_BATCH_STACK)
+	{
+		pairs = kmalloc_array(batch.count, sizeof(*pairs), GFP_KERNEL);
+		if(!pairs)
+			return -ENOMEM;
+	}
+
+	if(copy_from_user(pairs, (void __user *) batch.pairs,
+				batch.count * sizeof(*pairs)))
+	{
+		result = -EFAULT;
+		goto OUT;
+	}
+
+	for(i = 0; i < batch.count; i++)
+	{
+		if(!cdc_reg_valid(dev, pairs[i].reg))
+		{
+			result = -EINVAL;
+			goto OUT;
+		}
+	}
+
+	result = cdc_session_write(cf, pairs, batch.count);
+
+OUT:
+	if(pairs != stack_pairs)
+		kfree(pairs);
+
+	return result;
+}
+
+/* register snapshot: read a list or range of registers in one go. The reads
+ * run with local interrupts off so the values belong to the same moment of
+ * scanout, the results are copied to user space afterwards. */
+static long cdc_ioctl_read_batch(struct cdc_dev *dev, void __user *arg)
+{
+	cdc_reg_snapshot snap;
+	unsigned int stack_regs[CDC_REG_BATCH_STACK];
+	unsigned int stack_values[CDC_REG_BATCH_STACK];
+	unsigned int *regs = stack_regs;
+	unsigned int *values = stack_values;
+	unsigned long flags;
+	unsigned int i;
+	long result = 0;
+
+	if(copy_from_user(&snap, arg, sizeof(snap)))
+		return -EFAULT;
+
+	if(!snap.count)
+		return 0;
+	if(snap.count > CDC_REG_BATCH_MAX)
+		return -EINVAL;
+
+	if(snap.count > CDC_REG_BATCH_STACK)
+	{
+		regs = kmalloc_array(snap.count, sizeof(*regs), GFP_KERNEL);
+		values = kmalloc_array(snap.count, sizeof(*values), GFP_KERNEL);
+		if(!regs || !values)
+		{
+			result = -ENOMEM;
+			goto OUT;
+		}
+	}
+
+	if(snap.regs)
+	{
+		if(copy_from_user(regs, (void __user *) snap.regs,
+					snap.count * sizeof(*regs)))
+		{
+			result = -EFAULT;
+			goto OUT;
+		}
+	}
+	else
+	{
+		if(snap.first + snap.count < snap.first)
+		{
+			result = -EINVAL;
+			goto OUT;
+		}
+		for(i = 0; i < snap.count; i++)
+			regs[i] = snap.first + i;
+	}
+
+	for(i = 0; i < snap.count; i++)
+	{
+		if(!cdc_reg_valid(dev, regs[i]))
+		{
+			result = -EINVAL;
+			goto OUT;
+		}
+	}
+
+	spin_lock_irqsave(&dev->reg_slck, flags);
+	for(i = 0; i < snap.count; i++)
+		values[i] = cdc_reg_read(dev, regs[i]);
+	spin_unlock_irqrestore(&dev->reg_slck, flags);
+
+	if(copy_to_user((void __user *) snap.values, values,
+				snap.count * sizeof(*values)))
+		result = -EFAULT;
+
+OUT:
+	if(regs != stack_regs)
+		kfree(regs);
+	if(values != stack_values)
+		kfree(values);
+
+	return result;
+}
+
+/* commit completion fences: one fence per commit, signalled by the reload
+ * IRQ that latches the commit and thereby retires the buffers of the
+ * previous one */
+static const char *cdc_fence_get_driver_name(struct dma_fence *fence)
+{
+	return "tes-cdc";
+}
+
+static const char *cdc_fence_get_timeline_name(struct dma_fence *fence)
+{
+	return "cdc-commit";
+}
+
+static const struct dma_fence_ops cdc_fence_ops = {
+	.get_driver_name = cdc_fence_get_driver_name,
+	.get_timeline_name = cdc_fence_get_timeline_name,
+};
+
+static void cdc_commit_free(struct cdc_commit_job *job)
+{
+	if(job->in_fence)
+		dma_fence_put(job->in_fence);
+	if(job->out_fence)
+		dma_fence_put(job->out_fence);
+	cdc_buffer_unpin(job->pins);
+	kfree(job);
+}
+
+/* write the register images of all layers of a job and request a shadow
+ * reload in vertical blanking */
+static void cdc_commit_apply(struct cdc_commit_job *job)
+{
+	struct cdc_dev *dev = job->dev;
+	cdc_commit_layer *layer;
+	unsigned long flags;
+	unsigned int i, reg;
+
+	/* completion is signalled by the reload IRQ, the reference is dropped
+	 * when the commit retires */
+	cdc_irq_get(dev, CDC_IRQ_RELOAD);
+
+	spin_lock_irqsave(&dev->reg_slck, flags);
+	for(i = 0; i < job->count; i++)
+	{
+		layer = &job->layers[i];
+		for(reg = 0; reg < CDC_COMMIT_LAYER_REGS; reg++)
+		{
+			if(layer->mask & (1u << reg))
+				cdc_reg_write(dev, CDC_LAYER_REG(layer->layer, reg),
+						layer->regs[reg]);
+		}
+	}
+
+	/* the buffers of the previous commit stay pinned until this one is
+	 * latched */
+	cdc_buffer_scanout(dev, job->pins);
+
+	/* arm the commit and request the reload under reg_slck: the hard IRQ
+	 * sees neither or both, so it can not miss the commit nor take an
+	 * earlier reload for it */
+	spin_lock(&dev->irq_slck);
+	dev->commit_armed = job->seq;
+	dev->armed_fence = job->out_fence;
+	dev->armed_pins = job->pins;
+	job->out_fence = NULL;
+	job->pins = NULL;
+	dev->queued_job = NULL;
+	spin_unlock(&dev->irq_slck);
+
+	trace_cdc_commit_flip(dev, job->seq, job->count);
+	cdc_reg_write(dev, CDC_REG_GLOBAL_SHADOW_RELOAD,
+			CDC_REG_GLOBAL_SHADOW_RELOAD_VBLANK);
+	spin_unlock_irqrestore(&dev->reg_slck, flags);
+
+	cdc_commit_free(job);
+}
+
+static void cdc_commit_work(struct work_struct *work)
+{
+	struct cdc_dev *dev = container_of(work, struct cdc_dev, commit_work);
+	struct cdc_commit_job *job;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->irq_slck, flags);
+	job = dev->queued_job;
+	spin_unlock_irqrestore(&dev->irq_slck, flags);
+
+	if(job)
+		cdc_commit_apply(job);
+}
+
+/* the in-fence signalled (possibly in IRQ context of another driver) */
+static void cdc_commit_fence_cb(struct dma_fence *fence, struct dma_fence_cb *cb)
+{
+	struct cdc_commit_job *job = container_of(cb, struct cdc_commit_job, cb);
+
+	schedule_work(&job->dev->commit_work);
+}
+
+/* device removal: drop a commit that still waits for its in-fence and
+ * fail the fence of a commit that will never be latched */
+static void cdc_commit_cleanup(struct cdc_dev *dev)
+{
+	struct cdc_commit_job *job;
+	struct cdc_buffer_pins *pins;
+	struct dma_fence *fence;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->irq_slck, flags);
+	job = dev->queued_job;
+	spin_unlock_irqrestore(&dev->irq_slck, flags);
+
+	if(job && job->in_fence &&
+			dma_fence_remove_callback(job->in_fence, &job->cb))
+	{
+		spin_lock_irqsave(&dev->irq_slck, flags);
+		dev->queued_job = NULL;
+		spin_unlock_irqrestore(&dev->irq_slck, flags);
+
+		dma_fence_set_error(job->out_fence, -ENODEV);
+		dma_fence_signal(job->out_fence);
+		cdc_commit_free(job);
+	}
+	flush_work(&dev->commit_work);
+
+	spin_lock_irqsave(&dev->irq_slck, flags);
+	fence = dev->armed_fence;
+	dev->armed_fence = NULL;
+	pins = dev->armed_pins;
+	dev->armed_pins = NULL;
+	spin_unlock_irqrestore(&dev->irq_slck, flags);
+
+	cdc_buffer_unpin(pins);
+
+	if(fence)
+	{
+		dma_fence_set_error(fence, -ENODEV);
+		dma_fence_signal(fence);
+		dma_fence_put(fence);
+		cdc_irq_put(dev, CDC_IRQ_RELOAD);
+	}
+}
+
+static int cdc_commit_latched(struct cdc_dev *dev, u64 seq)
+{
+	unsigned long flags;
+	int latched;
+
+	spin_lock_irqsave(&dev->irq_slck, flags);
+	latched = dev->commit_done >= seq;
+	spin_unlock_irqrestore(&dev->irq_slck, flags);
+
+	return latched;
+}
+
+/* hand out a sync_file for the out-fence of a commit. The fd is reserved
+ * here and installed by the caller once nothing can fail anymore. */
+static int cdc_commit_out_fence(struct cdc_commit_job *job,
+		struct sync_file **sync_file)
+{
+	int fd;
+
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if(fd < 0)
+		return fd;
+
+	*sync_file = sync_file_create(job->out_fence);
+	if(!*sync_file)
+	{
+		put_unused_fd(fd);
+		return -ENOMEM;
+	}
+
+	return fd;
+}
+
+/* check the layer entries of a commit against the device */
+int cdc_commit_layers_valid(struct cdc_dev *dev, const cdc_commit_layer *layers,
+		unsigned int count)
+{
+	unsigned int i;
+
+	for(i = 0; i < count; i++)
+	{
+		if(layers[i].layer >= dev->layer_count ||
+				!cdc_reg_valid(dev, CDC_LAYER_REG(layers[i].layer,
+						CDC_COMMIT_LAYER_REGS - 1)) ||
+				(layers[i].mask & CDC_COMMIT_LAYER_RO_MASK) ||
+				(layers[i].mask >> CDC_COMMIT_LAYER_REGS))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* atomic commit: write the register images of all layers and request a
+ * shadow reload in vertical blanking. Only one commit can be in flight, a
+ * new one waits until the previous one was latched by the reload IRQ. With
+ * an in-fence the registers are written as soon as the fence signals,
+ * without blocking the caller. */
+static long cdc_ioctl_commit(struct cdc_file *cf, void __user *arg)
+{
+	struct cdc_dev *dev = cf->dev;
+	cdc_commit commit;
+	struct cdc_commit_job *job;
+	struct sync_file *sync_file = NULL;
+	unsigned long flags;
+	int fd = -1;
+	u64 seq;
+	long result = 0;
+
+	if(copy_from_user(&commit, arg, sizeof(commit)))
+		return -EFAULT;
+
+	if(commit.count > dev->layer_count)
+		return -EINVAL;
+
+	job = kzalloc(sizeof(*job) + commit.count * sizeof(job->layers[0]),
+			GFP_KERNEL);
+	if(!job)
+		return -ENOMEM;
+	job->dev = dev;
+	job->count = commit.count;
+
+	if(copy_from_user(job->layers, (void __user *) commit.layers,
+				commit.count * sizeof(job->layers[0])))
+	{
+		result = -EFAULT;
+		goto FAILED;
+	}
+
+	if(!cdc_commit_layers_valid(dev, job->layers, commit.count))
+	{
+		result = -EINVAL;
+		goto FAILED;
+	}
+
+	result = cdc_buffer_pin_commit(cf, job->layers, job->count, &job->pins);
+	if(result)
+		goto FAILED;
+
+	if(commit.flags & CDC_COMMIT_FLAG_IN_FENCE)
+	{
+		job->in_fence = sync_file_get_fence(commit.in_fence);
+		if(!job->in_fence)
+		{
+			result = -EINVAL;
+			goto FAILED;
+		}
+	}
+
+	if(mutex_lock_interruptible(&dev->commit_lock))
+	{
+		result = -ERESTARTSYS;
+		goto FAILED;
+	}
+
+	spin_lock_irqsave(&dev->irq_slck, flags);
+	seq = dev->commit_seq;
+	spin_unlock_irqrestore(&dev->irq_slck, flags);
+
+	if(!cdc_commit_latched(dev, seq))
+	{
+		if(commit.flags & CDC_COMMIT_FLAG_NONBLOCK)
+			result = -EBUSY;
+		else if(wait_event_interruptible(dev->commit_waitq,
+					cdc_commit_latched(dev, seq)))
+			result = -ERESTARTSYS;
+
+		if(result)
+			goto UNLOCK;
+	}
+
+	result = cdc_bw_admit(dev, job->layers, job->count);
+	if(result)
+		goto UNLOCK;
+
+	seq++;
+	job->seq = seq;
+	job->out_fence = kzalloc(sizeof(*job->out_fence), GFP_KERNEL);
+	if(!job->out_fence)
+	{
+		result = -ENOMEM;
+		goto UNLOCK;
+	}
+	dma_fence_init(job->out_fence, &cdc_fence_ops, &dev->fence_slck,
+			dev->fence_context, seq);
+
+	if(commit.flags & CDC_COMMIT_FLAG_OUT_FENCE)
+	{
+		fd = cdc_commit_out_fence(job, &sync_file);
+		if(fd < 0)
+		{
+			result = fd;
+			goto UNLOCK;
+		}
+	}
+
+	commit.sequence = seq;
+	commit.out_fence = fd;
+	if(copy_to_user(arg, &commit, sizeof(commit)))
+	{
+		if(sync_file)
+		{
+			fput(sync_file->file);
+			put_unused_fd(fd);
+		}
+		result = -EFAULT;
+		goto UNLOCK;
+	}
+
+	if(sync_file)
+		fd_install(fd, sync_file->file);
+
+	/* nothing can fail anymore: the commit becomes the one in flight */
+	spin_lock_irqsave(&dev->irq_slck, flags);
+	dev->commit_seq = seq;
+	dev->queued_job = job;
+	spin_unlock_irqrestore(&dev->irq_slck, flags);
+
+	trace_cdc_commit_submit(dev, seq, job->count);
+
+	if(!job->in_fence ||
+			dma_fence_add_callback(job->in_fence, &job->cb,
+				cdc_commit_fence_cb))
+		cdc_commit_apply(job);
 
-	/* extract the device structure and add it to the file pointer for easier
-	 * access */
-	dev = container_of(ip->i_cdev, struct cdc_dev, cdev);
-	fp->private_data = dev;
+	mutex_unlock(&dev->commit_lock);
+
+	/* the commit is submitted and reported: a restart would submit it
+	 * again */
+	if((commit.flags & CDC_COMMIT_FLAG_WAIT) &&
+			wait_event_interruptible(dev->commit_waitq,
+				cdc_commit_latched(dev, seq)))
+		return -EINTR;
 
 	return 0;
+
+UNLOCK:
+	mutex_unlock(&dev->commit_lock);
+FAILED:
+	cdc_commit_free(job);
+
+	return result;
+}
+
+u64 cdc_vblank_get(struct cdc_dev *dev, ktime_t *time)
+{
+	unsigned long flags;
+	u64 seq;
+
+	spin_lock_irqsave(&dev->irq_slck, flags);
+	seq = dev->vblank_seq;
+	if(time)
+		*time = dev->vblank_time;
+	spin_unlock_irqrestore(&dev->irq_slck, flags);
+
+	return seq;
+}
+
+/* deferred writes (lookup tables, mode set) are done from the line IRQ of a
+ * vblank after seq, while the scan is still in vertical blanking. A line
+ * IRQ programmed into the active lines never sees the blanking, the writes
+ * are only frame synchronous then. Called with reg_slck held. */
+bool cdc_vblank_window(struct cdc_dev *dev, u64 seq)
+{
+	u32 back, active, line;
+
+	if(cdc_vblank_get(dev, NULL) <= seq)
+		return false;
+
+	back = cdc_reg_read(dev, CDC_REG_GLOBAL_BACK_PORCH) & 0xffff;
+	active = cdc_reg_read(dev, CDC_REG_GLOBAL_ACTIVE_WIDTH) & 0xffff;
+	line = cdc_reg_read(dev, CDC_REG_GLOBAL_LINE_IRQ_POSITION) & 0xffff;
+	if(line > back && line <= active)
+		return true;
+
+	/* the scanline is the upper half of the position register */
+	line = cdc_reg_read(dev, CDC_REG_GLOBAL_POSITION) >> 16;
+
+	return line <= back || line > active;
+}
+
+/* wait until the vblank counter reaches an absolute or relative target */
+static long cdc_ioctl_wait_vblank(struct cdc_dev *dev, void __user *arg)
+{
+	cdc_vblank_wait vbl;
+	ktime_t time;
+	u64 target;
+	long result = 0;
+	long ret;
+
+	if(copy_from_user(&vbl, arg, sizeof(vbl)))
+		return -EFAULT;
+
+	/* frames are counted with the line IRQ, keep it enabled while waiting.
+	 * Enabling it brings the counter up to date. */
+	cdc_irq_get(dev, CDC_IRQ_LINE);
+
+	target = vbl.sequence;
+	if(vbl.flags & CDC_VBLANK_RELATIVE)
+		target += cdc_vblank_get(dev, NULL);
+
+	if(cdc_vblank_get(dev, NULL) < target)
+	{
+		if(vbl.timeout_ms)
+		{
+			ret = wait_event_interruptible_timeout(dev->vblank_waitq,
+					cdc_vblank_get(dev, NULL) >= target,
+					msecs_to_jiffies(vbl.timeout_ms));
+			if(ret < 0)
+				result = ret;
+			else if(!ret)
+				result = -ETIMEDOUT;
+		}
+		else if(wait_event_interruptible(dev->vblank_waitq,
+					cdc_vblank_get(dev, NULL) >= target))
+		{
+			result = -ERESTARTSYS;
+		}
+	}
+
+	vbl.sequence = cdc_vblank_get(dev, &time);
+	cdc_irq_put(dev, CDC_IRQ_LINE);
+	if(result && result != -ETIMEDOUT)
+		return result;
+
+	vbl.timestamp = ktime_to_ns(time);
+	if(copy_to_user(arg, &vbl, sizeof(vbl)))
+		return -EFAULT;
+
+	return result;
 }
 
 static long cdc_ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
 {
-	struct cdc_dev *dev = fp->private_data;
+	struct cdc_file *cf = fp->private_data;
+	struct cdc_dev *dev = cf->dev;
 	unsigned int cmd_nr;
 	cdc_settings cset;
-  static int cdc_reg;
+	cdc_event_stats stats;
+	cdc_reg_pair pair;
 
 	cmd_nr = _IOC_NR(cmd);
 	if (_IOC_DIR(cmd) == _IOC_WRITE)
@@ -53,18 +875,28 @@ static long cdc_ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
     {
       case CDC_IOCTL_REG_WRITE:
         /* direct register write: Register value in argument */
-        CDC_IO_WREG(CDC_IO_RADDR(dev->base_virt,
-              cdc_reg),
-            arg);
-        break;
+        pair.reg = cf->reg;
+        pair.value = arg;
+        return cdc_session_write(cf, &pair, 1);
       case CDC_IOCTL_SET_WORKING_REG:
-        if(arg > dev->span)
+        if(!cdc_reg_valid(dev, arg))
         {
           return -EINVAL;
         } else {
-          cdc_reg = arg;
+          cf->reg = arg;
         }
         break;
+      case CDC_IOCTL_NR_REG_WRITE_BATCH:
+        return cdc_ioctl_write_batch(cf, (void __user *) arg);
+      case CDC_IOCTL_NR_IRQ_SUBSCRIBE:
+        mutex_lock(&cf->txn_lock);
+        cdc_file_set_irq_mask(cf, arg);
+        mutex_unlock(&cf->txn_lock);
+        break;
+      case CDC_IOCTL_NR_BW_CONFIG:
+        return cdc_ioctl_bw_config(dev, (void __user *) arg);
+      case CDC_IOCTL_NR_BUFFER_RELEASE:
+        return cdc_ioctl_buffer_release(cf, arg);
       default:
         return -EINVAL;
     }
@@ -75,8 +907,7 @@ static long cdc_ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
     switch(cmd_nr)
     {
       case CDC_IOCTL_REG_READ:
-        if(!put_user(CDC_IO_RREG(CDC_IO_RADDR(dev->base_virt,
-                  cdc_reg)), (unsigned long*) arg))
+        if(put_user(cdc_reg_read_single(dev, cf->reg), (unsigned long*) arg))
           return -EFAULT;
         break;
       case CDC_IOCTL_NR_SETTINGS:
@@ -86,31 +917,199 @@ static long cdc_ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
         if(copy_to_user((void*) arg, (void*) &cset,
               sizeof(cdc_settings)))
         {
-          dev_err(fp->private_data,
+          dev_err(dev->device,
               "error while copying settings to user space\n");
           return -EFAULT;
         }
         break;
+      case CDC_IOCTL_NR_EVENT_STATS:
+        stats.lost = cf->events_lost;
+        stats.next_sequence = cf->event_tail;
+        if(copy_to_user((void __user *) arg, &stats, sizeof(stats)))
+          return -EFAULT;
+        break;
+      default:
+        return -EINVAL;
+    }
+	}
+	else if (_IOC_DIR(cmd) == (_IOC_READ | _IOC_WRITE))
+	{
+    switch(cmd_nr)
+    {
+      case CDC_IOCTL_NR_REG_READ_BATCH:
+        return cdc_ioctl_read_batch(dev, (void __user *) arg);
+      case CDC_IOCTL_NR_COMMIT:
+        return cdc_ioctl_commit(cf, (void __user *) arg);
+      case CDC_IOCTL_NR_WAIT_VBLANK:
+        return cdc_ioctl_wait_vblank(dev, (void __user *) arg);
+      case CDC_IOCTL_NR_BANDWIDTH:
+        return cdc_ioctl_bandwidth(dev, (void __user *) arg);
+      case CDC_IOCTL_NR_BUFFER_IMPORT:
+        return cdc_ioctl_buffer_import(cf, (void __user *) arg);
+      case CDC_IOCTL_NR_BUFFER_ALLOC:
+        return cdc_ioctl_buffer_alloc(cf, (void __user *) arg);
+      case CDC_IOCTL_NR_CLUT_UPLOAD:
+        return cdc_ioctl_clut_upload(dev, (void __user *) arg);
+      case CDC_IOCTL_NR_BG_UPLOAD:
+        return cdc_ioctl_bg_upload(dev, (void __user *) arg);
+      case CDC_IOCTL_NR_GAMMA_UPLOAD:
+        return cdc_ioctl_gamma_upload(dev, (void __user *) arg);
+      case CDC_IOCTL_NR_SET_MODE:
+        return cdc_ioctl_set_mode(dev, (void __user *) arg);
       default:
         return -EINVAL;
     }
+	}
+	else if (_IOC_DIR(cmd) == _IOC_NONE)
+	{
+    return cdc_ioctl_txn(cf, cmd_nr);
 	}
 	return 0;
 }
 
+/* append an event to the ring, called from the IRQ handler only */
+static void cdc_event_push(struct cdc_dev *dev, unsigned int status,
+		unsigned int position, ktime_t timestamp)
+{
+	u64 seq = atomic64_read(&dev->event_head);
+	struct cdc_event_slot *slot = &dev->events[seq & (CDC_EVENT_RING_SIZE - 1)];
+
+	/* invalidate the slot while it is rewritten: no reader waits for an
+	 * event that far in the future */
+	WRITE_ONCE(slot->tag, (u32) (seq + CDC_EVENT_RING_SIZE));
+	smp_wmb();
+	slot->event.sequence = seq;
+	slot->event.timestamp = ktime_to_ns(timestamp);
+	slot->event.status = status;
+	slot->event.position = position;
+	smp_wmb();
+	WRITE_ONCE(slot->tag, (u32) seq);
+
+	atomic64_set_release(&dev->event_head, seq + 1);
+}
+
+static int cdc_events_pending(struct cdc_file *cf)
+{
+	return atomic64_read_acquire(&cf->dev->event_head) != cf->event_tail;
+}
+
+/* fetch the event with sequence number *tail from the ring and advance
+ * *tail. Events the producer overwrote before they were copied are skipped
+ * and added to *lost. Returns 0 if there is no new event. */
+int cdc_event_fetch(struct cdc_dev *dev, u64 *tail, u64 *lost,
+		cdc_event *event)
+{
+	struct cdc_event_slot *slot;
+	u64 head;
+	u32 tag;
+
+	for(;;)
+	{
+		head = atomic64_read_acquire(&dev->event_head);
+		if(*tail == head)
+			return 0;
+
+		if(head - *tail > CDC_EVENT_RING_SIZE)
+		{
+			*lost += head - CDC_EVENT_RING_SIZE - *tail;
+			*tail = head - CDC_EVENT_RING_SIZE;
+		}
+
+		slot = &dev->events[*tail & (CDC_EVENT_RING_SIZE - 1)];
+		tag = READ_ONCE(slot->tag);
+		smp_rmb();
+		*event = slot->event;
+		smp_rmb();
+
+		if(tag == (u32) *tail && READ_ONCE(slot->tag) == tag)
+		{
+			(*tail)++;
+			return 1;
+		}
+
+		/* overwritten while copying */
+		(*lost)++;
+		(*tail)++;
+	}
+}
+
+/* copy the events of this file from the ring in chunks */
+static ssize_t cdc_read_events(struct cdc_file *cf, char __user *buff,
+		size_t count)
+{
+	cdc_event chunk[CDC_EVENT_READ_CHUNK];
+	size_t max_events = count / sizeof(cdc_event);
+	size_t copied = 0;
+	unsigned int n;
+	u64 tail, lost;
+
+	while(copied < max_events)
+	{
+		tail = cf->event_tail;
+		lost = cf->events_lost;
+		for(n = 0; n < CDC_EVENT_READ_CHUNK && copied + n < max_events; n++)
+		{
+			if(!cdc_event_fetch(cf->dev, &tail, &lost, &chunk[n]))
+				break;
+		}
+
+		if(!n)
+		{
+			cf->event_tail = tail;
+			cf->events_lost = lost;
+			break;
+		}
+
+		if(copy_to_user(buff + copied * sizeof(cdc_event), chunk,
+					n * sizeof(cdc_event)))
+			return copied ? copied * sizeof(cdc_event) : -EFAULT;
+
+		cf->event_tail = tail;
+		cf->events_lost = lost;
+		copied += n;
+	}
+
+	return copied * sizeof(cdc_event);
+}
+
 ssize_t cdc_read(struct file *filp, char __user *buff, size_t count, loff_t *offp)
 {
-	struct cdc_dev *dev = filp->private_data;
+	struct cdc_file *cf = filp->private_data;
+	struct cdc_dev *dev = cf->dev;
 	unsigned long flags;
 	int temp;
 
-	wait_event_interruptible(dev->irq_waitq, dev->irq_stat);
+	/* event interface */
+	if(count >= sizeof(cdc_event))
+	{
+		if(!cdc_events_pending(cf))
+		{
+			if(filp->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+			if(wait_event_interruptible(dev->irq_waitq, cdc_events_pending(cf)))
+				return -ERESTARTSYS;
+		}
+
+		return cdc_read_events(cf, buff, count);
+	}
+
+	if(!READ_ONCE(dev->irq_stat))
+	{
+		if(filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if(wait_event_interruptible(dev->irq_waitq, dev->irq_stat))
+			return -ERESTARTSYS;
+	}
 
 	spin_lock_irqsave(&dev->irq_slck, flags);
 	temp = dev->irq_stat;
 	dev->irq_stat = 0;
 	spin_unlock_irqrestore(&dev->irq_slck, flags);
 
+	/* the status word covers all events so far, so poll() does not report
+	 * them again */
+	cf->event_tail = atomic64_read_acquire(&dev->event_head);
+
 	if(count==sizeof(temp))
 	{
 		put_user(temp, buff);
@@ -120,34 +1119,256 @@ ssize_t cdc_read(struct file *filp, char __user *buff, size_t count, loff_t *off
 	return 0;
 }
 
+/* the device is readable while events are pending for this file, so it can
+ * be part of an application's poll/epoll loop */
+static __poll_t cdc_poll(struct file *fp, poll_table *wait)
+{
+	struct cdc_file *cf = fp->private_data;
+
+	poll_wait(fp, &cf->dev->irq_waitq, wait);
+
+	if(cdc_events_pending(cf))
+		return EPOLLIN | EPOLLRDNORM;
+
+	return 0;
+}
+
+/* writable register mappings bypass the register cache and the lookup
+ * table copies for their lifetime */
+static void cdc_regs_vm_open(struct vm_area_struct *vma)
+{
+	cdc_regcache_bypass(vma->vm_private_data, 1);
+	cdc_lut_mapped(vma->vm_private_data, 1);
+}
+
+static void cdc_regs_vm_close(struct vm_area_struct *vma)
+{
+	cdc_regcache_bypass(vma->vm_private_data, 0);
+	cdc_lut_mapped(vma->vm_private_data, 0);
+}
+
+static const struct vm_operations_struct cdc_regs_vm_ops = {
+	.open = cdc_regs_vm_open,
+	.close = cdc_regs_vm_close,
+};
+
+/* map the register window into user space (uncached), so register access
+ * does not need a kernel entry. Without write access to the device file
+ * the mapping is read-only and cannot be upgraded by mprotect. */
+static int cdc_mmap(struct file *fp, struct vm_area_struct *vma)
+{
+	struct cdc_file *cf = fp->private_data;
+	struct cdc_dev *dev = cf->dev;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long pfn;
+	int result;
+
+	if(vma->vm_pgoff >= CDC_MMAP_BUFFER_PGOFF)
+		return cdc_buffer_mmap(cf, vma);
+
+	if(vma->vm_pgoff != (CDC_MMAP_REGS_OFFSET >> PAGE_SHIFT))
+		return -EINVAL;
+
+	if(size > PAGE_ALIGN(dev->span + 1) || (dev->base_phys & ~PAGE_MASK))
+		return -EINVAL;
+
+	/* private copies of MMIO pages make no sense */
+	if(!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	if(!(fp->f_mode & FMODE_WRITE))
+	{
+		if(vma->vm_flags & VM_WRITE)
+			return -EACCES;
+		vma->vm_flags &= ~VM_MAYWRITE;
+	}
+
+	vma->vm_flags |= VM_IO | VM_DONTEXPAND | VM_DONTDUMP;
+	/* the registers of the simulated CDC are ordinary cached memory */
+	if(dev->sim)
+		pfn = cdc_sim_pfn(dev);
+	else
+	{
+		pfn = dev->base_phys >> PAGE_SHIFT;
+		vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	}
+
+	result = io_remap_pfn_range(vma, vma->vm_start, pfn, size,
+			vma->vm_page_prot);
+	if(result || !(vma->vm_flags & VM_MAYWRITE))
+		return result;
+
+	vma->vm_private_data = dev;
+	vma->vm_ops = &cdc_regs_vm_ops;
+	cdc_regs_vm_open(vma);
+
+	return 0;
+}
+
 static struct file_operations cdc_fops = {
 	.owner = THIS_MODULE,
 	.open = cdc_open,
+	.release = cdc_release,
 	.unlocked_ioctl = cdc_ioctl,
 	.read = cdc_read,
+	.poll = cdc_poll,
+	.mmap = cdc_mmap,
 };
 
+/* in-kernel IRQ handlers: called from the IRQ thread for every IRQ that
+ * matches their mask. They may sleep. */
+void cdc_irq_add_handler(struct cdc_dev *dev, struct cdc_irq_handler *handler)
+{
+	mutex_lock(&dev->irq_handler_lock);
+	list_add_tail(&handler->node, &dev->irq_handlers);
+	mutex_unlock(&dev->irq_handler_lock);
+}
+
+void cdc_irq_remove_handler(struct cdc_dev *dev, struct cdc_irq_handler *handler)
+{
+	mutex_lock(&dev->irq_handler_lock);
+	list_del(&handler->node);
+	mutex_unlock(&dev->irq_handler_lock);
+}
+
+/* CDC_IRQ_RELOAD: retire the armed commit and signal its fence */
+static void cdc_commit_irq(struct cdc_dev *dev, unsigned int status, void *data)
+{
+	struct dma_fence *fence = NULL;
+	struct cdc_buffer_pins *pins = NULL;
+	unsigned long flags;
+	u64 seq = 0;
+
+	/* only the commit armed when the reload IRQ was taken (with its reload
+	 * request latched) is retired, a coalesced one may predate it */
+	spin_lock_irqsave(&dev->irq_slck, flags);
+	if(dev->commit_done < dev->commit_reloaded &&
+			dev->commit_reloaded == dev->commit_armed)
+	{
+		seq = dev->commit_done = dev->commit_armed;
+		fence = dev->armed_fence;
+		dev->armed_fence = NULL;
+		pins = dev->armed_pins;
+		dev->armed_pins = NULL;
+	}
+	spin_unlock_irqrestore(&dev->irq_slck, flags);
+
+	if(fence)
+	{
+		trace_cdc_commit_retire(dev, seq);
+		dma_fence_signal(fence);
+		dma_fence_put(fence);
+		cdc_irq_put(dev, CDC_IRQ_RELOAD);
+		wake_up_interruptible_all(&dev->commit_waitq);
+	}
+
+	/* buffers of the previous commit are not scanned out anymore */
+	cdc_buffer_unpin(pins);
+}
+
+/* CDC_IRQ_LINE: the vblank counter itself is advanced in the hard IRQ so no
+ * frame is lost, waiters are woken here */
+static void cdc_vblank_irq(struct cdc_dev *dev, unsigned int status, void *data)
+{
+	wake_up_interruptible_all(&dev->vblank_waitq);
+}
+
+/* hard IRQ: acknowledge, timestamp and queue the event, everything else is
+ * done in the IRQ thread */
 static irqreturn_t std_irq_handler(int irq, void *dev_id)
 {
 	unsigned long flags;
 	struct cdc_dev *cdcd = dev_id;
+	ktime_t now;
+	s64 elapsed;
+	u32 position, reload = 0;
 	int status;
 
 	status = CDC_IO_RREG(CDC_IO_RADDR(cdcd->base_virt,CDC_REG_GLOBAL_IRQ_STATUS));
+	if(!status)
+		return IRQ_NONE;
 	CDC_IO_WREG(CDC_IO_RADDR(cdcd->base_virt, CDC_REG_GLOBAL_IRQ_CLEAR), status);
 
-	spin_lock_irqsave(&cdcd->irq_slck, flags);
+	now = ktime_get();
+	position = CDC_IO_RREG(CDC_IO_RADDR(cdcd->base_virt,
+				CDC_REG_GLOBAL_POSITION));
+	trace_cdc_irq(cdcd, status, position);
+	cdc_event_push(cdcd, status, position, now);
+
+	/* a commit is armed and its reload requested under reg_slck. If the
+	 * request is still pending, the reload was an earlier one (a mode set,
+	 * a raw register write) whose IRQ is only handled now. */
+	spin_lock_irqsave(&cdcd->reg_slck, flags);
+	if(status & CDC_IRQ_RELOAD)
+		reload = cdc_reg_read(cdcd, CDC_REG_GLOBAL_SHADOW_RELOAD);
+
+	spin_lock(&cdcd->irq_slck);
 	cdcd->irq_stat |= status;
+	cdcd->irq_pending |= status;
+	if((status & CDC_IRQ_RELOAD) &&
+			!(reload & CDC_REG_GLOBAL_SHADOW_RELOAD_VBLANK))
+		cdcd->commit_reloaded = cdcd->commit_armed;
+	if(status & CDC_IRQ_LINE)
+	{
+		elapsed = ktime_to_ns(ktime_sub(now, cdcd->vblank_time));
+		/* an estimated vblank less than half a frame ago is this one */
+		if(!cdcd->vblank_estimated || elapsed >= cdcd->vblank_period / 2)
+		{
+			if(!cdcd->vblank_estimated && cdcd->vblank_seq)
+				cdcd->vblank_period = elapsed;
+			cdcd->vblank_seq++;
+		}
+		cdcd->vblank_estimated = false;
+		cdcd->vblank_time = now;
+	}
+	spin_unlock(&cdcd->irq_slck);
+	spin_unlock_irqrestore(&cdcd->reg_slck, flags);
+
+	return IRQ_WAKE_THREAD;
+}
+
+/* IRQ thread: wake readers and dispatch to the in-kernel handlers */
+static irqreturn_t cdc_irq_thread(int irq, void *dev_id)
+{
+	struct cdc_dev *cdcd = dev_id;
+	struct cdc_irq_handler *handler;
+	unsigned long flags;
+	unsigned int status;
+
+	spin_lock_irqsave(&cdcd->irq_slck, flags);
+	status = cdcd->irq_pending;
+	cdcd->irq_pending = 0;
 	spin_unlock_irqrestore(&cdcd->irq_slck, flags);
 
 	wake_up_interruptible(&cdcd->irq_waitq);
 
+	mutex_lock(&cdcd->irq_handler_lock);
+	list_for_each_entry(handler, &cdcd->irq_handlers, node)
+	{
+		if(status & handler->mask)
+			handler->handler(cdcd, status & handler->mask, handler->data);
+	}
+	mutex_unlock(&cdcd->irq_handler_lock);
+
 	return IRQ_HANDLED;
 }
 
 static int register_irq(struct cdc_dev *dev)
 {
-	if(request_irq(dev->irq_no, std_irq_handler, 0, "TES CDC", (void*) dev))
+	dev->commit_irq.mask = CDC_IRQ_RELOAD;
+	dev->commit_irq.handler = cdc_commit_irq;
+	cdc_irq_add_handler(dev, &dev->commit_irq);
+
+	dev->vblank_irq.mask = CDC_IRQ_LINE;
+	dev->vblank_irq.handler = cdc_vblank_irq;
+	cdc_irq_add_handler(dev, &dev->vblank_irq);
+
+	dev->mode_irq.mask = CDC_IRQ_LINE;
+	dev->mode_irq.handler = cdc_mode_irq;
+	cdc_irq_add_handler(dev, &dev->mode_irq);
+
+	if(request_threaded_irq(dev->irq_no, std_irq_handler, cdc_irq_thread, 0,
+				"TES CDC", (void*) dev))
 	{
 		dev_err(dev->device, "irq cannot be registered\n");
 		return -EBUSY;
@@ -164,51 +1385,46 @@ static void unregister_irq(struct cdc_dev *dev)
 /* create character class and devices */
 static int cdc_setup_device(struct cdc_dev *dev)
 {
+	struct device *device;
 	int result = 0;
 
-	result = alloc_chrdev_region(&dev->dev, 0, CDC_DEVICE_CNT,
-			CDC_DEVICE_NAME);
-
-	if (result < 0) {
-		dev_err(dev->device, "can't alloc_chrdev_region\n");
-		goto CHR_FAILED;
-	}
-
-	cdc_class = class_create(THIS_MODULE, CDC_DEVICE_CLASS);
-	if(!cdc_class)
-	{
-		dev_err(dev->device, "cannot create class %s\n", CDC_DEVICE_CLASS);
-		result = -EBUSY;
-		goto CLASS_FAILED;
-	}
-
-	dev->device = device_create(cdc_class, NULL, dev->dev, dev, CDC_DEVICE_NAME);
-	if(!dev->device)
+	result = ida_simple_get(&cdc_minors, 0, CDC_DEVICE_MAX, GFP_KERNEL);
+	if(result < 0)
 	{
-		dev_err(dev->device, "cannot create device %s\n", CDC_DEVICE_NAME);
-		result = -EBUSY;
-		goto DEVICE_FAILED;
+		dev_err(dev->device, "no free minor for another CDC\n");
+		goto ID_FAILED;
 	}
+	dev->id = result;
+	dev->dev = MKDEV(MAJOR(cdc_devt), dev->id);
 
 	cdev_init(&dev->cdev, &cdc_fops);
 	dev->cdev.owner = THIS_MODULE;
 
-	result = cdev_add(&dev->cdev, dev->dev, CDC_DEVICE_CNT);
+	result = cdev_add(&dev->cdev, dev->dev, 1);
 	if(result)
 	{
 		dev_err(dev->device, "can't register char device\n");
 		goto DEV_FAILED;
 	}
 
+	device = device_create(cdc_class, dev->dma_dev, dev->dev, dev,
+			CDC_DEVICE_NAME "%u", dev->id);
+	if(IS_ERR(device))
+	{
+		dev_err(dev->device, "cannot create device %s%u\n", CDC_DEVICE_NAME,
+				dev->id);
+		result = PTR_ERR(device);
+		goto DEVICE_FAILED;
+	}
+	dev->device = device;
+
 	return 0;
 
-DEV_FAILED:
-	device_destroy(cdc_class, dev->dev);
 DEVICE_FAILED:
-	class_destroy(cdc_class);
-CLASS_FAILED:
-	unregister_chrdev_region(dev->dev, CDC_DEVICE_CNT);
-CHR_FAILED:
+	cdev_del(&dev->cdev);
+DEV_FAILED:
+	ida_simple_remove(&cdc_minors, dev->id);
+ID_FAILED:
 
 	return result;
 }
@@ -223,9 +1439,9 @@ static void cdc_log_params(struct cdc_dev *dev)
 static void cdc_shutdown_device(struct cdc_dev *dev)
 {
 	device_destroy(cdc_class, dev->dev);
-	class_destroy(cdc_class);
-	unregister_chrdev_region(dev->dev, CDC_DEVICE_CNT);
 	cdev_del(&dev->cdev);
+	ida_simple_remove(&cdc_minors, dev->id);
+	dev->device = dev->dma_dev;
 }
 
 /* platform device functions:
@@ -248,23 +1464,45 @@ static int cdc_probe(struct platform_device *pdev)
 	}
 	platform_set_drvdata(pdev, cdc);
 	cdc->device = &pdev->dev;
+	cdc->dma_dev = &pdev->dev;
 	np = pdev->dev.of_node;
-	if(!np)
+	if(cdc_sim_device(pdev))
+	{
+		result = cdc_sim_init(cdc, pdev);
+		if(result)
+			return result;
+	}
+	else if(!np)
 	{
 		dev_err(&pdev->dev,
 			"driver should only be instanciated over device tree!\n");
 		return -ENODEV;
 	}
-
-	of_address_to_resource(np, 0, &rsrc);
-	cdc->base_phys = rsrc.start;
-	cdc->span = rsrc.end - rsrc.start;
-	cdc->irq_no = of_irq_to_resource(np, 0, &rsrc);
+	else
+	{
+		of_address_to_resource(np, 0, &rsrc);
+		cdc->base_phys = rsrc.start;
+		cdc->span = rsrc.end - rsrc.start;
+		cdc->irq_no = of_irq_to_resource(np, 0, &rsrc);
+	}
 
 	cdc_log_params(cdc);
 
 	spin_lock_init(&cdc->irq_slck);
+	spin_lock_init(&cdc->reg_slck);
 	init_waitqueue_head(&cdc->irq_waitq);
+	init_waitqueue_head(&cdc->commit_waitq);
+	init_waitqueue_head(&cdc->vblank_waitq);
+	INIT_LIST_HEAD(&cdc->irq_handlers);
+	mutex_init(&cdc->irq_handler_lock);
+	mutex_init(&cdc->commit_lock);
+	spin_lock_init(&cdc->fence_slck);
+	INIT_WORK(&cdc->commit_work, cdc_commit_work);
+	cdc->fence_context = dma_fence_context_alloc(1);
+
+	/* the simulated CDC has its registers in memory already */
+	if(cdc->sim)
+		goto MAPPED;
 
 	if (!request_mem_region(cdc->base_phys, cdc->span, "TES CDC"))
 	{
@@ -280,6 +1518,8 @@ static int cdc_probe(struct platform_device *pdev)
 		goto IO_FAILED;
 	}
 
+MAPPED:
+
 	result = CDC_IO_RREG(CDC_IO_RADDR(cdc->base_virt,
 				CDC_REG_GLOBAL_HW_REVISION));
 	if(result < 1)
@@ -303,14 +1543,42 @@ static int cdc_probe(struct platform_device *pdev)
 	else
 	{
 		dev_info(&pdev->dev, "CDC supports %d layers!\n", result);
+		cdc->layer_count = result;
 	}
 
-	result = cdc_setup_device(cdc);
+	result = cdc_regcache_init(cdc);
 	if(result)
 	{
 		goto DEV_FAILED;
 	}
 
+	/* IRQs are enabled on demand */
+	spin_lock_irq(&cdc->reg_slck);
+	cdc_reg_write(cdc, CDC_REG_GLOBAL_IRQ_ENABLE, 0);
+	spin_unlock_irq(&cdc->reg_slck);
+
+	/* framebuffer address registers are 32 bit */
+	if(dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(32)))
+		dev_warn(&pdev->dev, "no suitable DMA available\n");
+
+	result = cdc_buffer_init(cdc);
+	if(result)
+	{
+		goto BUFFER_FAILED;
+	}
+
+	result = cdc_lut_init(cdc);
+	if(result)
+	{
+		goto LUT_FAILED;
+	}
+
+	result = cdc_setup_device(cdc);
+	if(result)
+	{
+		goto SETUP_FAILED;
+	}
+
 	/* register cdc IRQs */
 	result = register_irq(cdc);
 	if(result)
@@ -319,13 +1587,29 @@ static int cdc_probe(struct platform_device *pdev)
 		goto IRQ_FAILED;
 	}
 
+	if(cdc->sim)
+		cdc_sim_start(cdc);
+
+	cdc_stats_init(cdc);
+
 	dev_warn(&pdev->dev, "This driver is PRELIMINARY. Do NOT use in production environment!\n");
 
 	return 0;
 
 IRQ_FAILED:
 	cdc_shutdown_device(cdc);
+SETUP_FAILED:
+	cdc_lut_exit(cdc);
+LUT_FAILED:
+	cdc_buffer_exit(cdc);
+BUFFER_FAILED:
+	cdc_regcache_exit(cdc);
 DEV_FAILED:
+	if(cdc->sim)
+	{
+		cdc_sim_exit(cdc);
+		return -EBUSY;
+	}
 	iounmap(cdc->base_virt);
 IO_FAILED:
 	release_mem_region(cdc->base_phys, cdc->span);
@@ -336,10 +1620,24 @@ IO_FAILED:
 static int cdc_remove(struct platform_device *pdev)
 {
 	struct cdc_dev *cdc = platform_get_drvdata(pdev);
+	cdc_stats_exit(cdc);
+	if(cdc->sim)
+		cdc_sim_stop(cdc);
 	unregister_irq(cdc);
-	iounmap(cdc->base_virt);
-	release_mem_region(cdc->base_phys, cdc->span);
+	cdc_commit_cleanup(cdc);
 	cdc_shutdown_device(cdc);
+	cdc_lut_exit(cdc);
+	cdc_buffer_exit(cdc);
+	cdc_regcache_exit(cdc);
+	if(cdc->sim)
+	{
+		cdc_sim_exit(cdc);
+	}
+	else
+	{
+		iounmap(cdc->base_virt);
+		release_mem_region(cdc->base_phys, cdc->span);
+	}
 	devm_kfree(&pdev->dev, cdc);
 	return 0;
 }
@@ -365,9 +1663,45 @@ static int __init _cdc_init(void)
 {
 	int result = 0;
 
+	result = alloc_chrdev_region(&cdc_devt, 0, CDC_DEVICE_MAX,
+			CDC_DEVICE_NAME);
+	if(result < 0)
+	{
+		printk(KERN_ALERT "%s: can't alloc_chrdev_region\n", __func__);
+		return result;
+	}
+
+	cdc_class = class_create(THIS_MODULE, CDC_DEVICE_CLASS);
+	if(IS_ERR(cdc_class))
+	{
+		printk(KERN_ALERT "%s: cannot create class %s\n", __func__,
+				CDC_DEVICE_CLASS);
+		result = PTR_ERR(cdc_class);
+		goto CLASS_FAILED;
+	}
+
 	result = platform_driver_register(&cdc_driver);
 	if(result)
+	{
 		printk(KERN_ALERT "%s: failed to register platform driver\n", __func__);
+		goto DRIVER_FAILED;
+	}
+
+	result = cdc_sim_register();
+	if(result)
+	{
+		printk(KERN_ALERT "%s: failed to register simulated CDC\n", __func__);
+		goto SIM_FAILED;
+	}
+
+	return 0;
+
+SIM_FAILED:
+	platform_driver_unregister(&cdc_driver);
+DRIVER_FAILED:
+	class_destroy(cdc_class);
+CLASS_FAILED:
+	unregister_chrdev_region(cdc_devt, CDC_DEVICE_MAX);
 
 	return result;
 
@@ -375,7 +1709,11 @@ static int __init _cdc_init(void)
 
 static void __exit _cdc_exit(void)
 {
+	cdc_sim_unregister();
 	platform_driver_unregister(&cdc_driver);
+	class_destroy(cdc_class);
+	unregister_chrdev_region(cdc_devt, CDC_DEVICE_MAX);
+	ida_destroy(&cdc_minors);
 }
 
 module_init(_cdc_init);
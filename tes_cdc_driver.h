@@ -9,16 +9,420 @@
 /* Read and write share same IOCTL number as the IOW and IOR allow distinction */
 #define CDC_IOCTL_REG_WRITE (0x03)
 #define CDC_IOCTL_REG_READ (0x03)
+#define CDC_IOCTL_NR_REG_WRITE_BATCH (0x04)
+#define CDC_IOCTL_NR_REG_READ_BATCH (0x05)
+#define CDC_IOCTL_NR_TXN_BEGIN (0x06)
+#define CDC_IOCTL_NR_TXN_COMMIT (0x07)
+#define CDC_IOCTL_NR_TXN_ABORT (0x08)
+#define CDC_IOCTL_NR_COMMIT (0x09)
+#define CDC_IOCTL_NR_EVENT_STATS (0x0a)
+#define CDC_IOCTL_NR_WAIT_VBLANK (0x0b)
+#define CDC_IOCTL_NR_IRQ_SUBSCRIBE (0x0c)
+#define CDC_IOCTL_NR_BANDWIDTH (0x0d)
+#define CDC_IOCTL_NR_BW_CONFIG (0x0e)
+#define CDC_IOCTL_NR_BUFFER_IMPORT (0x0f)
+#define CDC_IOCTL_NR_BUFFER_RELEASE (0x10)
+#define CDC_IOCTL_NR_BUFFER_ALLOC (0x11)
+#define CDC_IOCTL_NR_CLUT_UPLOAD (0x12)
+#define CDC_IOCTL_NR_BG_UPLOAD (0x13)
+#define CDC_IOCTL_NR_GAMMA_UPLOAD (0x14)
+#define CDC_IOCTL_NR_SET_MODE (0x15)
 #define CDC_IOCTL_SET_REG (_IOW(CDC_IOCTL_TYPE,CDC_IOCTL_SET_WORKING_REG,unsigned int))
 #define CDC_IOCTL_W (_IOW(CDC_IOCTL_TYPE,CDC_IOCTL_REG_WRITE,unsigned int))
 #define CDC_IOCTL_R (_IOR(CDC_IOCTL_TYPE,CDC_IOCTL_REG_READ,unsigned int))
 #define CDC_IOCTL_GET_SETTINGS (_IOR(CDC_IOCTL_TYPE,CDC_IOCTL_NR_SETTINGS,CDC_SETTINGS))
+#define CDC_IOCTL_W_BATCH (_IOW(CDC_IOCTL_TYPE,CDC_IOCTL_NR_REG_WRITE_BATCH,cdc_reg_batch))
+#define CDC_IOCTL_R_BATCH (_IOWR(CDC_IOCTL_TYPE,CDC_IOCTL_NR_REG_READ_BATCH,cdc_reg_snapshot))
+/* Register write transactions per open file: after TXN_BEGIN all writes
+ * (W and W_BATCH) of this file are collected and written in one piece on
+ * TXN_COMMIT, without interleaving with writes of other clients. Reads
+ * always access the hardware. */
+#define CDC_IOCTL_TXN_BEGIN (_IO(CDC_IOCTL_TYPE,CDC_IOCTL_NR_TXN_BEGIN))
+#define CDC_IOCTL_TXN_COMMIT (_IO(CDC_IOCTL_TYPE,CDC_IOCTL_NR_TXN_COMMIT))
+#define CDC_IOCTL_TXN_ABORT (_IO(CDC_IOCTL_TYPE,CDC_IOCTL_NR_TXN_ABORT))
+#define CDC_IOCTL_COMMIT (_IOWR(CDC_IOCTL_TYPE,CDC_IOCTL_NR_COMMIT,cdc_commit))
+#define CDC_IOCTL_EVENT_STATS (_IOR(CDC_IOCTL_TYPE,CDC_IOCTL_NR_EVENT_STATS,cdc_event_stats))
+#define CDC_IOCTL_WAIT_VBLANK (_IOWR(CDC_IOCTL_TYPE,CDC_IOCTL_NR_WAIT_VBLANK,cdc_vblank_wait))
+/* IRQ subscription of this file: CDC_IRQ_* mask in argument. The driver
+ * enables only the IRQs somebody subscribed to or needs internally. A write
+ * of CDC_REG_GLOBAL_IRQ_ENABLE through the register IOCTLs does the same. */
+#define CDC_IOCTL_IRQ_SUBSCRIBE (_IOW(CDC_IOCTL_TYPE,CDC_IOCTL_NR_IRQ_SUBSCRIBE,unsigned int))
+#define CDC_IOCTL_BANDWIDTH (_IOWR(CDC_IOCTL_TYPE,CDC_IOCTL_NR_BANDWIDTH,cdc_bandwidth))
+#define CDC_IOCTL_BW_CONFIG (_IOW(CDC_IOCTL_TYPE,CDC_IOCTL_NR_BW_CONFIG,cdc_bw_config))
+#define CDC_IOCTL_BUFFER_IMPORT (_IOWR(CDC_IOCTL_TYPE,CDC_IOCTL_NR_BUFFER_IMPORT,cdc_buffer_import))
+/* Release a buffer handle of this file: handle in argument. A buffer that
+ * is still scanned out stays pinned until a commit replaced it. */
+#define CDC_IOCTL_BUFFER_RELEASE (_IOW(CDC_IOCTL_TYPE,CDC_IOCTL_NR_BUFFER_RELEASE,unsigned int))
+#define CDC_IOCTL_BUFFER_ALLOC (_IOWR(CDC_IOCTL_TYPE,CDC_IOCTL_NR_BUFFER_ALLOC,cdc_buffer_alloc))
+#define CDC_IOCTL_CLUT_UPLOAD (_IOWR(CDC_IOCTL_TYPE,CDC_IOCTL_NR_CLUT_UPLOAD,cdc_lut_upload))
+#define CDC_IOCTL_BG_UPLOAD (_IOWR(CDC_IOCTL_TYPE,CDC_IOCTL_NR_BG_UPLOAD,cdc_bg_upload))
+/* Gamma table upload, works like CDC_IOCTL_CLUT_UPLOAD (layer is ignored).
+ * The table size depends on the gamma correction technique of the CDC:
+ * CDC_GAMMA_RAM_SIZE entries in RAM mode, CDC_GAMMA_INTER_SIZE support
+ * points in interpolation mode. Fails with ENODEV without gamma
+ * correction. */
+#define CDC_IOCTL_GAMMA_UPLOAD (_IOWR(CDC_IOCTL_TYPE,CDC_IOCTL_NR_GAMMA_UPLOAD,cdc_lut_upload))
+#define CDC_IOCTL_SET_MODE (_IOWR(CDC_IOCTL_TYPE,CDC_IOCTL_NR_SET_MODE,cdc_mode))
 
-/* CDC resource information */
+/* mmap() offset of the register window. The mapping is uncached and only
+ * writable if the device was opened for writing. Register n is found at
+ * byte offset n * 4. */
+#define CDC_MMAP_REGS_OFFSET (0x0u)
+
+/* Maximum number of register accesses in one batch IOCTL */
+#define CDC_REG_BATCH_MAX (1024u)
+
+/* CDC resource information. base_phys is 0 for a simulated CDC. */
 typedef struct
 {
 	unsigned long base_phys;
 	unsigned long span;
 } cdc_settings;
 
+/* Single register access: register index (not byte offset) and value */
+typedef struct
+{
+	unsigned int reg;
+	unsigned int value;
+} cdc_reg_pair;
+
+/* Batched register write (CDC_IOCTL_W_BATCH). All registers are validated
+ * before the first one is written, so a bad index leaves the CDC untouched. */
+typedef struct
+{
+	unsigned int count;
+	cdc_reg_pair *pairs;
+} cdc_reg_batch;
+
+/* Register snapshot (CDC_IOCTL_R_BATCH). If regs is NULL, count consecutive
+ * registers starting at first are read, otherwise the count indices listed
+ * in regs. The values are captured back-to-back with interrupts disabled
+ * and stored to values in request order. */
+typedef struct
+{
+	unsigned int count;
+	unsigned int first;
+	unsigned int *regs;
+	unsigned int *values;
+} cdc_reg_snapshot;
+
+/* Number of per layer registers (CDC_REG_LAYER_CONFIG_1 up to
+ * CDC_REG_LAYER_YCBCR_SCALE_2 in cdc_base.h) */
+#define CDC_COMMIT_LAYER_REGS (0x1du)
+
+/* Register image of one layer in an atomic commit. regs is indexed with the
+ * CDC_REG_LAYER_* offsets and bit n of mask selects regs[n] for writing.
+ * The read-only config registers, the layer reload register and the CLUT
+ * port cannot be part of a commit. */
+typedef struct
+{
+	unsigned int layer;
+	unsigned int mask;
+	unsigned int regs[CDC_COMMIT_LAYER_REGS];
+} cdc_commit_layer;
+
+/* Commit flags:
+ *  CDC_COMMIT_FLAG_WAIT      - return after the commit was latched by the CDC
+ *                              (EINTR if interrupted by a signal; the
+ *                              commit is submitted anyway and sequence
+ *                              and out_fence are valid)
+ *  CDC_COMMIT_FLAG_NONBLOCK  - fail with EBUSY instead of waiting if the
+ *                              previous commit has not been latched yet
+ *  CDC_COMMIT_FLAG_IN_FENCE  - in_fence is a sync_file fd; the registers are
+ *                              written once it signalled
+ *  CDC_COMMIT_FLAG_OUT_FENCE - return a sync_file fd in out_fence that
+ *                              signals when the commit was latched, i.e. the
+ *                              buffers of the previous commit are retired */
+#define CDC_COMMIT_FLAG_WAIT (0x1u)
+#define CDC_COMMIT_FLAG_NONBLOCK (0x2u)
+#define CDC_COMMIT_FLAG_IN_FENCE (0x4u)
+#define CDC_COMMIT_FLAG_OUT_FENCE (0x8u)
+
+/* Atomic multi-layer commit (CDC_IOCTL_COMMIT). All layer registers are
+ * written and then a shadow reload in vertical blanking is requested, so
+ * the whole set becomes visible in the same frame. sequence returns the
+ * number of the commit; it is complete once the reload IRQ fired. */
+typedef struct
+{
+	unsigned int flags;
+	unsigned int count;
+	cdc_commit_layer *layers;
+	int in_fence;
+	int out_fence;
+	unsigned long long sequence;
+} cdc_commit;
+
+/* IRQ event. read() with a buffer of one or more cdc_event returns all
+ * events since the last read (as many as fit), oldest first. A read of
+ * sizeof(int) bytes still returns the accumulated CDC_IRQ_* bits.
+ *
+ * sequence  - per device event number, increases by one for every IRQ
+ * timestamp - CLOCK_MONOTONIC time of the IRQ in ns
+ * status    - CDC_IRQ_* bits of this IRQ
+ * position  - CDC_REG_GLOBAL_POSITION at IRQ time */
+typedef struct
+{
+	unsigned long long sequence;
+	long long timestamp;
+	unsigned int status;
+	unsigned int position;
+} cdc_event;
+
+/* Event statistics of an open file (CDC_IOCTL_EVENT_STATS)
+ *
+ * lost          - events overwritten before this file read them
+ * next_sequence - sequence number of the next event to be read */
+typedef struct
+{
+	unsigned long long lost;
+	unsigned long long next_sequence;
+} cdc_event_stats;
+
+/* Vblank wait flags:
+ *  CDC_VBLANK_RELATIVE - sequence is relative to the current vblank */
+#define CDC_VBLANK_RELATIVE (0x1u)
+
+/* Wait for a vblank (CDC_IOCTL_WAIT_VBLANK). The driver counts frames with
+ * the line IRQ, so its position (see cdc_setScanlineIRQPosition) defines the
+ * point of the frame that is reported. A relative wait for 0 returns the
+ * current vblank immediately. While nobody waits for vblanks the line IRQ
+ * is off; the frames in between are added from the frame period when it is
+ * enabled again, so absolute sequences stay valid.
+ *
+ * flags      - CDC_VBLANK_* flags
+ * timeout_ms - give up with ETIMEDOUT after this time, 0 waits forever
+ * sequence   - in: vblank to wait for, out: vblank that was reached
+ * timestamp  - out: CLOCK_MONOTONIC time of that vblank in ns */
+typedef struct
+{
+	unsigned int flags;
+	unsigned int timeout_ms;
+	unsigned long long sequence;
+	long long timestamp;
+} cdc_vblank_wait;
+
+/* Maximum number of layers reported by CDC_IOCTL_BANDWIDTH */
+#define CDC_BW_LAYERS_MAX (8u)
+
+/* Memory bandwidth of one layer or of all layers together
+ *
+ * frame_bytes - bytes fetched per frame
+ * average     - bytes/s averaged over the frame
+ * peak        - bytes/s while the layer window is scanned out (for the
+ *               total, the sum of all layers as windows may overlap) */
+typedef struct
+{
+	unsigned long long frame_bytes;
+	unsigned long long average;
+	unsigned long long peak;
+} cdc_bw_usage;
+
+/* Bandwidth estimate (CDC_IOCTL_BANDWIDTH) of the current configuration with
+ * the layer registers of a proposed commit applied on top (count and layers
+ * as in cdc_commit, count 0 for the current configuration). Rates are 0
+ * as long as the pixel clock is unknown.
+ *
+ * pixel_clock_khz - out: pixel clock the estimate is based on
+ * budget          - out: configured bus budget in bytes/s, 0 if none
+ * layer_count     - out: number of valid entries in layer
+ * total           - out: all layers
+ * layer           - out: per layer, indexed by layer number */
+typedef struct
+{
+	unsigned int count;
+	cdc_commit_layer *layers;
+	unsigned int pixel_clock_khz;
+	unsigned long long budget;
+	unsigned int layer_count;
+	cdc_bw_usage total;
+	cdc_bw_usage layer[CDC_BW_LAYERS_MAX];
+} cdc_bandwidth;
+
+/* Highest pixel clock accepted by CDC_IOCTL_BW_CONFIG and CDC_IOCTL_SET_MODE
+ * in kHz, larger values fail with EINVAL */
+#define CDC_PIXEL_CLOCK_MAX_KHZ (600000u)
+
+/* Bandwidth model configuration (CDC_IOCTL_BW_CONFIG). If budget is set,
+ * commits whose total peak bandwidth exceeds it fail with ENOSPC.
+ *
+ * pixel_clock_khz - pixel clock of the current video mode
+ * budget          - bus budget in bytes/s, 0 disables admission control */
+typedef struct
+{
+	unsigned int pixel_clock_khz;
+	unsigned long long budget;
+} cdc_bw_config;
+
+/* dma-buf import (CDC_IOCTL_BUFFER_IMPORT). The buffer is attached to and
+ * mapped for the CDC; it must be contiguous in the CDC's address space.
+ * addr can be used for the framebuffer start registers
+ * (CDC_REG_LAYER_FB_START, CDC_REG_LAYER_AUX0/1_FB_START) in an atomic
+ * commit of the same file, which pins the buffer until a later commit
+ * replaced it. The handle is released with CDC_IOCTL_BUFFER_RELEASE or
+ * when the file is closed.
+ *
+ * fd     - in: dma-buf file descriptor
+ * handle - out: buffer handle of this file
+ * addr   - out: CDC bus address of the buffer
+ * size   - out: buffer size in bytes */
+typedef struct
+{
+	int fd;
+	unsigned int handle;
+	unsigned long long addr;
+	unsigned long long size;
+} cdc_buffer_import;
+
+/* Line pitch alignment of allocated buffers in bytes */
+#define CDC_BUFFER_PITCH_ALIGN (64u)
+
+/* Scanout buffer allocation (CDC_IOCTL_BUFFER_ALLOC). The buffer is
+ * physically contiguous and can be mapped write-combined with mmap() at
+ * offset. Handle and addr are used like those of an imported buffer (see
+ * cdc_buffer_import), addr being the value for cdc_layer_setCBAddress.
+ *
+ * width  - in: width in pixels
+ * height - in: height in lines
+ * format - in: CDC_FBMODE_* pixel format
+ * handle - out: buffer handle of this file
+ * pitch  - out: line pitch in bytes
+ * addr   - out: CDC bus address of the buffer
+ * size   - out: buffer size in bytes (at most 256 MiB)
+ * offset - out: mmap() offset of the buffer (below 2 GiB) */
+typedef struct
+{
+	unsigned int width;
+	unsigned int height;
+	unsigned int format;
+	unsigned int handle;
+	unsigned int pitch;
+	unsigned long long addr;
+	unsigned long long size;
+	unsigned long long offset;
+} cdc_buffer_alloc;
+
+/* Lookup table upload flags:
+ *  CDC_LUT_FLAG_VBLANK - write the changed entries in the next vertical
+ *                        blanking (from the line IRQ, which should be
+ *                        programmed into the blanking) instead of
+ *                        immediately, as the tables are not shadowed; later
+ *                        uploads before that vblank are merged, entries that
+ *                        do not fit into one blanking follow in the next
+ *  CDC_LUT_FLAG_FORCE  - write all entries, also those the driver believes
+ *                        to be unchanged. While the register window is
+ *                        mapped writable all entries are written anyway. */
+#define CDC_LUT_FLAG_VBLANK (0x1u)
+#define CDC_LUT_FLAG_FORCE (0x2u)
+
+/* Number of CLUT entries per layer */
+#define CDC_CLUT_SIZE (256u)
+
+/* Number of gamma table entries (0x00RRGGBB) per cdc_gamma_mode */
+#define CDC_GAMMA_RAM_SIZE (256u)
+#define CDC_GAMMA_INTER_SIZE (16u)
+
+/* Lookup table upload (CDC_IOCTL_CLUT_UPLOAD). The driver keeps a copy of
+ * every table and only writes the entries that differ from it.
+ *
+ * layer   - in: layer of the CLUT
+ * flags   - in: CDC_LUT_FLAG_* flags
+ * start   - in: first entry
+ * count   - in: number of entries
+ * entries - in: 0x00RRGGBB colors
+ * written - out: number of entries that were written (or queued) */
+typedef struct
+{
+	unsigned int layer;
+	unsigned int flags;
+	unsigned int start;
+	unsigned int count;
+	unsigned int *entries;
+	unsigned int written;
+} cdc_lut_upload;
+
+/* Number of words in the background layer RAM */
+#define CDC_BG_RAM_SIZE (512u)
+
+/* Background upload flag: also write base and inc (with the RAM words, so
+ * with CDC_LUT_FLAG_VBLANK a tile set and its configuration are switched in
+ * the same vblank) */
+#define CDC_BG_FLAG_CONFIG (0x100u)
+
+/* Background layer RAM upload (CDC_IOCTL_BG_UPLOAD). Like the CLUT upload,
+ * only words that differ from the driver's copy of the RAM are written. A
+ * whole tile set (see CDC_BG_TILED_32x16, CDC_BG_TILED_16x32 and
+ * CDC_BG_LINEAR) can be uploaded in one call. count may be 0 to change
+ * only the configuration.
+ *
+ * flags   - in: CDC_LUT_FLAG_* and CDC_BG_FLAG_* flags
+ * start   - in: first word
+ * count   - in: number of words
+ * data    - in: RAM words
+ * base    - in: CDC_REG_GLOBAL_BG_LAYER_BASE value (CDC_BG_FLAG_CONFIG)
+ * inc     - in: CDC_REG_GLOBAL_BG_LAYER_INC value (CDC_BG_FLAG_CONFIG)
+ * written - out: number of words that were written (or queued) */
+typedef struct
+{
+	unsigned int flags;
+	unsigned int start;
+	unsigned int count;
+	unsigned int *data;
+	unsigned int base;
+	unsigned int inc;
+	unsigned int written;
+} cdc_bg_upload;
+
+/* Mode set flags:
+ *  CDC_MODE_FLAG_TEST - only validate the mode and report what would change
+ *  CDC_MODE_FLAG_FULL - reprogram with the CDC disabled, as cdc_setTiming
+ *                       does, instead of switching in the next vblank */
+#define CDC_MODE_FLAG_TEST (0x1u)
+#define CDC_MODE_FLAG_FULL (0x2u)
+
+/* Parts of the timing changed by a mode set (cdc_mode.changed) */
+#define CDC_MODE_CHANGED_SYNC (0x01u)
+#define CDC_MODE_CHANGED_BACK_PORCH (0x02u)
+#define CDC_MODE_CHANGED_ACTIVE (0x04u)
+#define CDC_MODE_CHANGED_TOTAL (0x08u)
+#define CDC_MODE_CHANGED_POLARITY (0x10u)
+/* the CDC was disabled while it was reprogrammed */
+#define CDC_MODE_CHANGED_FULL (0x20u)
+
+/* Video mode set (CDC_IOCTL_SET_MODE). The fields are those of
+ * cdc_video_mode, with the pixel clock in kHz. Only the timing registers
+ * and polarities that differ from the current mode are written. The timing
+ * registers are not shadowed: if the active area or the totals change, or
+ * CDC_MODE_FLAG_FULL is set, a running CDC is disabled while the registers
+ * are written. Otherwise sync widths, porches and polarities are written
+ * together in the next vertical blanking (from the line IRQ, which should
+ * be programmed into the blanking) and the CDC keeps running; the IOCTL
+ * returns before that. Fails with EOPNOTSUPP if the timing or the polarity
+ * is not programmable on this CDC. The pixel clock itself is generated
+ * outside the CDC; it is passed on to the bandwidth model (see
+ * cdc_bw_config) unless 0.
+ *
+ * flags           - in: CDC_MODE_FLAG_* flags
+ * h_sync ...      - in: timing in pixels and lines as in cdc_video_mode
+ * pixel_clock_khz - in: pixel clock of the mode in kHz, 0 if unknown
+ * neg_hsync ...   - in: polarities as in cdc_video_mode
+ * changed         - out: CDC_MODE_CHANGED_* bits */
+typedef struct
+{
+	unsigned int flags;
+	unsigned short h_sync;
+	unsigned short h_bporch;
+	unsigned short h_width;
+	unsigned short h_fporch;
+	unsigned short v_sync;
+	unsigned short v_bporch;
+	unsigned short v_height;
+	unsigned short v_fporch;
+	unsigned int pixel_clock_khz;
+	unsigned int neg_hsync;
+	unsigned int neg_vsync;
+	unsigned int neg_blank;
+	unsigned int inv_clk;
+	unsigned int changed;
+} cdc_mode;
+
 #endif
@@ -0,0 +1,485 @@
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/bitmap.h>
+#include <linux/uaccess.h>
+#include "tes_cdc_module.h"
+#include "tes_cdc_driver.h"
+#include "cdc_base.h"
+
+/* Lookup tables (layer CLUTs, background layer RAM, gamma table). The CDC
+ * tables are written one entry per register access and are not shadowed, so
+ * the driver keeps a copy of each table: uploads only write the entries that
+ * changed and can be deferred to the next vblank, where the queued entries
+ * are written from the line IRQ as long as the scan is in vertical
+ * blanking. */
+
+static struct cdc_lut *cdc_lut_alloc(struct cdc_dev *dev, unsigned int size,
+		unsigned int layer, u32 value_mask,
+		void (*write)(struct cdc_dev *, struct cdc_lut *, unsigned int, u32))
+{
+	size_t bitmap = BITS_TO_LONGS(size) * sizeof(unsigned long);
+	struct cdc_lut *lut;
+
+	lut = kzalloc(sizeof(*lut) + 2 * size * sizeof(u32) + 2 * bitmap,
+			GFP_KERNEL);
+	if(!lut)
+		return NULL;
+
+	lut->size = size;
+	lut->layer = layer;
+	lut->value_mask = value_mask;
+	lut->write = write;
+	lut->cache = (u32 *) (lut + 1);
+	lut->next = lut->cache + size;
+	lut->valid = (unsigned long *) (lut->next + size);
+	lut->dirty = (unsigned long *) ((char *) lut->valid + bitmap);
+	list_add_tail(&lut->node, &dev->luts);
+
+	return lut;
+}
+
+/* record an entry written to the hardware, called with lut_slck held. While
+ * the registers are mapped writable the entry may be overwritten any time,
+ * so it is not marked valid. */
+static void cdc_lut_written(struct cdc_dev *dev, struct cdc_lut *lut,
+		unsigned int index, u32 value)
+{
+	lut->cache[index] = value;
+	if(!dev->lut_mapped)
+		__set_bit(index, lut->valid);
+}
+
+/* write or queue entries start..start+count-1 and then the extra
+ * registers (if any), returns the number of entries written or queued */
+static unsigned int cdc_lut_update(struct cdc_dev *dev, struct cdc_lut *lut,
+		unsigned int start, unsigned int count, const u32 *values,
+		const cdc_reg_pair *extra, unsigned int extra_count,
+		unsigned int flags)
+{
+	unsigned int force = flags & CDC_LUT_FLAG_FORCE;
+	unsigned long irqflags;
+	unsigned int i, n = 0;
+	int same;
+	u32 value;
+
+	spin_lock_irqsave(&dev->lut_slck, irqflags);
+
+	if(flags & CDC_LUT_FLAG_VBLANK)
+	{
+		for(i = start; i < start + count; i++)
+		{
+			value = values[i - start] & lut->value_mask;
+			same = test_bit(i, lut->valid) && lut->cache[i] == value;
+
+			if(test_bit(i, lut->dirty))
+			{
+				if(lut->next[i] == value)
+					continue;
+				/* changed back before it was written */
+				if(same && !force)
+				{
+					__clear_bit(i, lut->dirty);
+					lut->pending--;
+					continue;
+				}
+			}
+			else
+			{
+				if(same && !force)
+					continue;
+				__set_bit(i, lut->dirty);
+				lut->pending++;
+			}
+
+			lut->next[i] = value;
+			n++;
+		}
+
+		if(extra_count)
+		{
+			memcpy(lut->extra, extra, extra_count * sizeof(*extra));
+			lut->extra_count = extra_count;
+		}
+
+		/* written from the line IRQ of the next vblank, not of one that
+		 * fired before the entries were queued */
+		if((lut->pending || lut->extra_count) && !dev->lut_irq_held)
+		{
+			cdc_irq_get(dev, CDC_IRQ_LINE);
+			dev->lut_irq_held = 1;
+			dev->lut_seq = cdc_vblank_get(dev, NULL);
+		}
+	}
+	else
+	{
+		spin_lock(&dev->reg_slck);
+		for(i = start; i < start + count; i++)
+		{
+			value = values[i - start] & lut->value_mask;
+
+			/* an immediate write overrides a queued one */
+			if(test_bit(i, lut->dirty))
+			{
+				__clear_bit(i, lut->dirty);
+				lut->pending--;
+			}
+			else if(!force && test_bit(i, lut->valid) &&
+					lut->cache[i] == value)
+			{
+				continue;
+			}
+
+			lut->write(dev, lut, i, value);
+			cdc_lut_written(dev, lut, i, value);
+			n++;
+		}
+
+		if(extra_count)
+		{
+			for(i = 0; i < extra_count; i++)
+				cdc_reg_write(dev, extra[i].reg, extra[i].value);
+			lut->extra_count = 0;
+		}
+		spin_unlock(&dev->reg_slck);
+	}
+
+	spin_unlock_irqrestore(&dev->lut_slck, irqflags);
+
+	return n;
+}
+
+/* lock both for a chunk of queued writes, false if the vertical blanking
+ * is over (or did not start yet) */
+static bool cdc_lut_flush_lock(struct cdc_dev *dev, unsigned long *flags)
+{
+	spin_lock_irqsave(&dev->lut_slck, *flags);
+	spin_lock(&dev->reg_slck);
+	if(dev->lut_irq_held && cdc_vblank_window(dev, dev->lut_seq))
+		return true;
+
+	spin_unlock(&dev->reg_slck);
+	spin_unlock_irqrestore(&dev->lut_slck, *flags);
+
+	return false;
+}
+
+/* CDC_IRQ_LINE: write the queued entries in chunks, with IRQs enabled and
+ * the scanline checked in between. Whatever does not fit into the
+ * blanking is written in the next one. */
+static void cdc_lut_irq(struct cdc_dev *dev, unsigned int status, void *data)
+{
+	struct cdc_lut *lut;
+	unsigned long flags;
+	unsigned int i, n = 0;
+	bool pending = false;
+
+	if(!cdc_lut_flush_lock(dev, &flags))
+		return;
+
+	list_for_each_entry(lut, &dev->luts, node)
+	{
+		for_each_set_bit(i, lut->dirty, lut->size)
+		{
+			if(++n % CDC_LUT_FLUSH_CHUNK == 0)
+			{
+				spin_unlock(&dev->reg_slck);
+				spin_unlock_irqrestore(&dev->lut_slck, flags);
+				if(!cdc_lut_flush_lock(dev, &flags))
+					return;
+				/* written immediately or snooped meanwhile */
+				if(!test_bit(i, lut->dirty))
+					continue;
+			}
+
+			lut->write(dev, lut, i, lut->next[i]);
+			cdc_lut_written(dev, lut, i, lut->next[i]);
+			__clear_bit(i, lut->dirty);
+			lut->pending--;
+		}
+
+		for(i = 0; i < lut->extra_count; i++)
+			cdc_reg_write(dev, lut->extra[i].reg, lut->extra[i].value);
+		lut->extra_count = 0;
+	}
+	spin_unlock(&dev->reg_slck);
+
+	/* entries queued behind the flush while the locks were dropped */
+	list_for_each_entry(lut, &dev->luts, node)
+		pending |= lut->pending || lut->extra_count;
+	if(!pending)
+		dev->lut_irq_held = 0;
+	spin_unlock_irqrestore(&dev->lut_slck, flags);
+
+	if(!pending)
+		cdc_irq_put(dev, CDC_IRQ_LINE);
+}
+
+/* layer CLUT: entry index in the upper byte, color in the lower 24 bit */
+static void cdc_clut_write(struct cdc_dev *dev, struct cdc_lut *lut,
+		unsigned int index, u32 value)
+{
+	cdc_reg_write(dev, CDC_LAYER_REG(lut->layer, CDC_REG_LAYER_CLUT),
+			(index << 24) | value);
+}
+
+/* background layer RAM: word address, then the data */
+static void cdc_bg_write(struct cdc_dev *dev, struct cdc_lut *lut,
+		unsigned int index, u32 value)
+{
+	cdc_reg_write(dev, CDC_REG_GLOBAL_BG_LAYER_ADDR, index);
+	cdc_reg_write(dev, CDC_REG_GLOBAL_BG_LAYER_DATA, value);
+}
+
+/* gamma table: entry index in the upper byte, like the CLUT */
+static void cdc_gamma_write(struct cdc_dev *dev, struct cdc_lut *lut,
+		unsigned int index, u32 value)
+{
+	cdc_reg_write(dev, CDC_REG_GLOBAL_GAMMA, (index << 24) | value);
+}
+
+/* a raw write of an entry, called with lut_slck held. It is newer than a
+ * queued value, which must not overwrite it in the next vblank. */
+static void cdc_lut_snoop_entry(struct cdc_dev *dev, struct cdc_lut *lut,
+		unsigned int index, u32 value)
+{
+	if(test_bit(index, lut->dirty))
+	{
+		__clear_bit(index, lut->dirty);
+		lut->pending--;
+	}
+	cdc_lut_written(dev, lut, index, value & lut->value_mask);
+}
+
+/* keep the copies up to date with tables written through the register
+ * IOCTLs. Called with lut_slck held across the writes, so a queued entry
+ * can not be flushed over a raw write in between. */
+void cdc_lut_snoop(struct cdc_dev *dev, const cdc_reg_pair *pairs,
+		unsigned int count)
+{
+	struct cdc_lut *lut;
+	unsigned int i, layer, index;
+
+	lockdep_assert_held(&dev->lut_slck);
+
+	for(i = 0; i < count; i++)
+	{
+		/* the RAM address of a data write is not known for sure (it may
+		 * have been set through the mmap), so the copy is dropped */
+		if(pairs[i].reg == CDC_REG_GLOBAL_BG_LAYER_DATA)
+		{
+			bitmap_zero(dev->bg->valid, dev->bg->size);
+			continue;
+		}
+
+		if(pairs[i].reg == CDC_REG_GLOBAL_GAMMA && dev->gamma)
+		{
+			lut = dev->gamma;
+			index = pairs[i].value >> 24;
+			if(index >= lut->size)
+				continue;
+
+			cdc_lut_snoop_entry(dev, lut, index, pairs[i].value);
+			continue;
+		}
+
+		if(pairs[i].reg < CDC_LAYER_SPAN ||
+				pairs[i].reg % CDC_LAYER_SPAN != CDC_REG_LAYER_CLUT)
+			continue;
+
+		layer = pairs[i].reg / CDC_LAYER_SPAN - 1;
+		if(layer >= dev->layer_count)
+			continue;
+
+		lut = dev->clut[layer];
+		index = pairs[i].value >> 24;
+
+		cdc_lut_snoop_entry(dev, lut, index, pairs[i].value);
+	}
+}
+
+/* writable register mappings: the tables can be written behind the driver's
+ * back, so the copies are dropped and not rebuilt while they exist */
+void cdc_lut_mapped(struct cdc_dev *dev, int enable)
+{
+	struct cdc_lut *lut;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->lut_slck, flags);
+	if(enable)
+		dev->lut_mapped++;
+	else if(!WARN_ON(!dev->lut_mapped))
+		dev->lut_mapped--;
+	list_for_each_entry(lut, &dev->luts, node)
+		bitmap_zero(lut->valid, lut->size);
+	spin_unlock_irqrestore(&dev->lut_slck, flags);
+}
+
+long cdc_ioctl_clut_upload(struct cdc_dev *dev, void __user *arg)
+{
+	cdc_lut_upload upload;
+	u32 *values;
+
+	if(copy_from_user(&upload, arg, sizeof(upload)))
+		return -EFAULT;
+
+	if(upload.layer >= dev->layer_count || !upload.count ||
+			upload.count > CDC_CLUT_SIZE ||
+			upload.start > CDC_CLUT_SIZE - upload.count)
+		return -EINVAL;
+
+	values = memdup_user((void __user *) upload.entries,
+			upload.count * sizeof(*values));
+	if(IS_ERR(values))
+		return PTR_ERR(values);
+
+	upload.written = cdc_lut_update(dev, dev->clut[upload.layer],
+			upload.start, upload.count, values, NULL, 0, upload.flags);
+	kfree(values);
+
+	if(copy_to_user(arg, &upload, sizeof(upload)))
+		return -EFAULT;
+
+	return 0;
+}
+
+long cdc_ioctl_gamma_upload(struct cdc_dev *dev, void __user *arg)
+{
+	cdc_lut_upload upload;
+	u32 *values;
+
+	if(!dev->gamma)
+		return -ENODEV;
+
+	if(copy_from_user(&upload, arg, sizeof(upload)))
+		return -EFAULT;
+
+	if(!upload.count || upload.count > dev->gamma->size ||
+			upload.start > dev->gamma->size - upload.count)
+		return -EINVAL;
+
+	values = memdup_user((void __user *) upload.entries,
+			upload.count * sizeof(*values));
+	if(IS_ERR(values))
+		return PTR_ERR(values);
+
+	upload.written = cdc_lut_update(dev, dev->gamma, upload.start,
+			upload.count, values, NULL, 0, upload.flags);
+	kfree(values);
+
+	if(copy_to_user(arg, &upload, sizeof(upload)))
+		return -EFAULT;
+
+	return 0;
+}
+
+long cdc_ioctl_bg_upload(struct cdc_dev *dev, void __user *arg)
+{
+	cdc_bg_upload upload;
+	cdc_reg_pair config[CDC_LUT_EXTRA_MAX];
+	unsigned int config_count = 0;
+	u32 *values = NULL;
+
+	if(copy_from_user(&upload, arg, sizeof(upload)))
+		return -EFAULT;
+
+	if(upload.count > CDC_BG_RAM_SIZE ||
+			upload.start > CDC_BG_RAM_SIZE - upload.count)
+		return -EINVAL;
+
+	if(upload.flags & CDC_BG_FLAG_CONFIG)
+	{
+		config[0].reg = CDC_REG_GLOBAL_BG_LAYER_BASE;
+		config[0].value = upload.base;
+		config[1].reg = CDC_REG_GLOBAL_BG_LAYER_INC;
+		config[1].value = upload.inc;
+		config_count = 2;
+	}
+
+	if(upload.count)
+	{
+		values = memdup_user((void __user *) upload.data,
+				upload.count * sizeof(*values));
+		if(IS_ERR(values))
+			return PTR_ERR(values);
+	}
+
+	upload.written = cdc_lut_update(dev, dev->bg, upload.start, upload.count,
+			values, config, config_count, upload.flags);
+	kfree(values);
+
+	if(copy_to_user(arg, &upload, sizeof(upload)))
+		return -EFAULT;
+
+	return 0;
+}
+
+int cdc_lut_init(struct cdc_dev *dev)
+{
+	unsigned int gamma_mode;
+	unsigned int i;
+
+	spin_lock_init(&dev->lut_slck);
+	INIT_LIST_HEAD(&dev->luts);
+
+	dev->clut = kcalloc(dev->layer_count, sizeof(*dev->clut), GFP_KERNEL);
+	if(!dev->clut)
+		goto FAILED;
+
+	for(i = 0; i < dev->layer_count; i++)
+	{
+		dev->clut[i] = cdc_lut_alloc(dev, CDC_CLUT_SIZE, i, 0x00ffffffu,
+				cdc_clut_write);
+		if(!dev->clut[i])
+			goto FAILED;
+	}
+
+	dev->bg = cdc_lut_alloc(dev, CDC_BG_RAM_SIZE, 0, 0xffffffffu,
+			cdc_bg_write);
+	if(!dev->bg)
+		goto FAILED;
+
+	/* the table size depends on the gamma correction technique */
+	gamma_mode = (cdc_reg_read_single(dev, CDC_REG_GLOBAL_CONFIG1) >>
+			CDC_CONFIG1_GAMMA_SHIFT) & CDC_CONFIG1_GAMMA_MASK;
+	if(gamma_mode == CDC_GAMMA_MODE_RAM || gamma_mode == CDC_GAMMA_MODE_INTER)
+	{
+		dev->gamma = cdc_lut_alloc(dev, gamma_mode == CDC_GAMMA_MODE_RAM ?
+				CDC_GAMMA_RAM_SIZE : CDC_GAMMA_INTER_SIZE, 0, 0x00ffffffu,
+				cdc_gamma_write);
+		if(!dev->gamma)
+			goto FAILED;
+	}
+
+	dev->lut_irq.mask = CDC_IRQ_LINE;
+	dev->lut_irq.handler = cdc_lut_irq;
+	cdc_irq_add_handler(dev, &dev->lut_irq);
+
+	return 0;
+
+FAILED:
+	cdc_lut_exit(dev);
+
+	return -ENOMEM;
+}
+
+void cdc_lut_exit(struct cdc_dev *dev)
+{
+	struct cdc_lut *lut, *tmp;
+
+	if(dev->lut_irq.handler)
+		cdc_irq_remove_handler(dev, &dev->lut_irq);
+	if(dev->lut_irq_held)
+		cdc_irq_put(dev, CDC_IRQ_LINE);
+	dev->lut_irq_held = 0;
+
+	list_for_each_entry_safe(lut, tmp, &dev->luts, node)
+	{
+		list_del(&lut->node);
+		kfree(lut);
+	}
+	kfree(dev->clut);
+	dev->clut = NULL;
+	dev->bg = NULL;
+	dev->gamma = NULL;
+}
@@ -0,0 +1,235 @@
+#include <linux/kernel.h>
+#include <linux/uaccess.h>
+#include <asm/io.h>
+#include "tes_cdc_module.h"
+#include "tes_cdc_driver.h"
+#include "cdc_base.h"
+
+/* Incremental mode set. The timing registers hold accumulated values
+ * (sync, sync + back porch, ...) minus one, horizontal in the upper and
+ * vertical in the lower half. Only the layer registers are shadowed, so a
+ * running CDC is disabled while the active area or the totals change. Sync
+ * width, porches and polarities are written in the next vertical blanking
+ * instead, from the line IRQ, while the CDC keeps running. Only the
+ * registers that differ are written. */
+
+/* timing registers in the order of CDC_MODE_CHANGED_SYNC..._TOTAL */
+static const unsigned int cdc_mode_regs[CDC_MODE_TIMING_REGS] = {
+	CDC_REG_GLOBAL_SYNC_SIZE,
+	CDC_REG_GLOBAL_BACK_PORCH,
+	CDC_REG_GLOBAL_ACTIVE_WIDTH,
+	CDC_REG_GLOBAL_TOTAL_WIDTH,
+};
+
+/* build the register values, false if the mode does not fit */
+static bool cdc_mode_timing(const cdc_mode *mode, u32 *timing)
+{
+	u32 h = 0, v = 0;
+	u32 h_parts[] = { mode->h_sync, mode->h_bporch, mode->h_width,
+		mode->h_fporch };
+	u32 v_parts[] = { mode->v_sync, mode->v_bporch, mode->v_height,
+		mode->v_fporch };
+	unsigned int i;
+
+	if(!mode->h_sync || !mode->h_width || !mode->v_sync || !mode->v_height)
+		return false;
+
+	for(i = 0; i < ARRAY_SIZE(cdc_mode_regs); i++)
+	{
+		h += h_parts[i];
+		v += v_parts[i];
+		if(h > 0x10000 || v > 0x10000)
+			return false;
+		timing[i] = ((h - 1) << 16) | (v - 1);
+	}
+
+	return true;
+}
+
+static u32 cdc_mode_polarity(const cdc_mode *mode)
+{
+	u32 control = 0;
+
+	if(mode->neg_hsync)
+		control |= CDC_REG_GLOBAL_CONTROL_HSYNC;
+	if(mode->neg_vsync)
+		control |= CDC_REG_GLOBAL_CONTROL_VSYNC;
+	if(mode->neg_blank)
+		control |= CDC_REG_GLOBAL_CONTROL_BLANK;
+	if(mode->inv_clk)
+		control |= CDC_REG_GLOBAL_CONTROL_CLK_POL;
+
+	return control;
+}
+
+/* write the deferred part of a mode set, called with reg_slck held */
+static void cdc_mode_flush(struct cdc_dev *dev)
+{
+	unsigned int i;
+	u32 control;
+
+	for(i = 0; i < ARRAY_SIZE(cdc_mode_regs); i++)
+	{
+		if(dev->mode_changed & (CDC_MODE_CHANGED_SYNC << i))
+			cdc_reg_write(dev, cdc_mode_regs[i], dev->mode_timing[i]);
+	}
+
+	if(dev->mode_changed & CDC_MODE_CHANGED_POLARITY)
+	{
+		control = cdc_reg_read(dev, CDC_REG_GLOBAL_CONTROL) &
+			~(CDC_REG_GLOBAL_CONTROL_SF_TRG | CDC_CONTROL_POLARITY_MASK);
+		cdc_reg_write(dev, CDC_REG_GLOBAL_CONTROL,
+				control | dev->mode_polarity);
+	}
+
+	dev->mode_changed = 0;
+}
+
+/* CDC_IRQ_LINE: write a deferred mode set in vertical blanking */
+void cdc_mode_irq(struct cdc_dev *dev, unsigned int status, void *data)
+{
+	unsigned long flags;
+	bool done = false;
+
+	spin_lock_irqsave(&dev->reg_slck, flags);
+	if(dev->mode_irq_held && cdc_vblank_window(dev, dev->mode_seq))
+	{
+		cdc_mode_flush(dev);
+		dev->mode_irq_held = 0;
+		done = true;
+	}
+	spin_unlock_irqrestore(&dev->reg_slck, flags);
+
+	if(done)
+		cdc_irq_put(dev, CDC_IRQ_LINE);
+}
+
+/* timing and polarity the CDC runs with once a deferred mode set is
+ * written, called with reg_slck held */
+static u32 cdc_mode_current(struct cdc_dev *dev, unsigned int i)
+{
+	if(dev->mode_changed & (CDC_MODE_CHANGED_SYNC << i))
+		return dev->mode_timing[i];
+
+	return cdc_reg_read(dev, cdc_mode_regs[i]);
+}
+
+static u32 cdc_mode_current_polarity(struct cdc_dev *dev, u32 control)
+{
+	if(dev->mode_changed & CDC_MODE_CHANGED_POLARITY)
+		return dev->mode_polarity;
+
+	return control & CDC_CONTROL_POLARITY_MASK;
+}
+
+long cdc_ioctl_set_mode(struct cdc_dev *dev, void __user *arg)
+{
+	u32 timing[ARRAY_SIZE(cdc_mode_regs)];
+	u32 config, control, polarity;
+	unsigned long flags;
+	unsigned int i;
+	cdc_mode mode;
+	bool keep = false, release = false;
+	long result = 0;
+
+	if(copy_from_user(&mode, arg, sizeof(mode)))
+		return -EFAULT;
+
+	if((mode.flags & ~(CDC_MODE_FLAG_TEST | CDC_MODE_FLAG_FULL)) ||
+			mode.pixel_clock_khz > CDC_PIXEL_CLOCK_MAX_KHZ)
+		return -EINVAL;
+
+	if(!cdc_mode_timing(&mode, timing))
+		return -EINVAL;
+	polarity = cdc_mode_polarity(&mode);
+
+	/* a deferred mode set is written from the line IRQ. Enabling it also
+	 * brings the vblank counter up to date. */
+	cdc_irq_get(dev, CDC_IRQ_LINE);
+
+	mutex_lock(&dev->commit_lock);
+	spin_lock_irqsave(&dev->reg_slck, flags);
+
+	config = cdc_reg_read(dev, CDC_REG_GLOBAL_CONFIG1);
+	control = cdc_reg_read(dev, CDC_REG_GLOBAL_CONTROL) &
+		~CDC_REG_GLOBAL_CONTROL_SF_TRG;
+
+	mode.changed = 0;
+	for(i = 0; i < ARRAY_SIZE(cdc_mode_regs); i++)
+	{
+		if(cdc_mode_current(dev, i) != timing[i])
+			mode.changed |= CDC_MODE_CHANGED_SYNC << i;
+	}
+	if(cdc_mode_current_polarity(dev, control) != polarity)
+		mode.changed |= CDC_MODE_CHANGED_POLARITY;
+
+	if(((mode.changed & ~CDC_MODE_CHANGED_POLARITY) &&
+				!(config & CDC_CONFIG1_TIMING)) ||
+			((mode.changed & CDC_MODE_CHANGED_POLARITY) &&
+			 !(config & CDC_CONFIG1_SYNC_POLARITY)))
+	{
+		result = -EOPNOTSUPP;
+		goto UNLOCK;
+	}
+
+	/* a running CDC would scan out frames of the wrong size while the
+	 * active area or the totals change */
+	if(mode.changed && (control & CDC_REG_GLOBAL_CONTROL_ENABLE) &&
+			((mode.changed & (CDC_MODE_CHANGED_ACTIVE |
+					CDC_MODE_CHANGED_TOTAL)) ||
+			 (mode.flags & CDC_MODE_FLAG_FULL)))
+		mode.changed |= CDC_MODE_CHANGED_FULL;
+
+	if(!mode.changed || (mode.flags & CDC_MODE_FLAG_TEST))
+		goto UNLOCK;
+
+	/* merged with a deferred mode set, timing holds all the values */
+	dev->mode_changed |= mode.changed & ~CDC_MODE_CHANGED_FULL;
+	memcpy(dev->mode_timing, timing, sizeof(timing));
+	dev->mode_polarity = polarity;
+
+	/* sync width, porches and polarities of a running CDC change together
+	 * in the next vertical blanking */
+	if((control & CDC_REG_GLOBAL_CONTROL_ENABLE) &&
+			!(mode.changed & CDC_MODE_CHANGED_FULL))
+	{
+		dev->mode_seq = cdc_vblank_get(dev, NULL);
+		keep = !dev->mode_irq_held;
+		dev->mode_irq_held = 1;
+		goto UNLOCK;
+	}
+
+	if(mode.changed & CDC_MODE_CHANGED_FULL)
+		cdc_reg_write(dev, CDC_REG_GLOBAL_CONTROL,
+				control & ~CDC_REG_GLOBAL_CONTROL_ENABLE);
+
+	cdc_mode_flush(dev);
+
+	/* the CDC runs again after a full mode set */
+	if(mode.changed & CDC_MODE_CHANGED_FULL)
+		cdc_reg_write(dev, CDC_REG_GLOBAL_CONTROL,
+				(cdc_reg_read(dev, CDC_REG_GLOBAL_CONTROL) &
+				 ~CDC_REG_GLOBAL_CONTROL_SF_TRG) |
+				CDC_REG_GLOBAL_CONTROL_ENABLE);
+
+	release = dev->mode_irq_held;
+	dev->mode_irq_held = 0;
+
+UNLOCK:
+	spin_unlock_irqrestore(&dev->reg_slck, flags);
+
+	if(!result && mode.pixel_clock_khz && !(mode.flags & CDC_MODE_FLAG_TEST))
+		dev->pixel_clock_khz = mode.pixel_clock_khz;
+	mutex_unlock(&dev->commit_lock);
+
+	/* the reference of a deferred mode set is kept until it is written */
+	if(!keep)
+		cdc_irq_put(dev, CDC_IRQ_LINE);
+	if(release)
+		cdc_irq_put(dev, CDC_IRQ_LINE);
+
+	if(!result && copy_to_user(arg, &mode, sizeof(mode)))
+		result = -EFAULT;
+
+	return result;
+}
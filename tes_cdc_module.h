@@ -5,11 +5,107 @@
 #include <linux/device.h>
 #include <linux/cdev.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/dma-fence.h>
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/dma-buf.h>
+#include "tes_cdc_driver.h"
+#include "cdc_base.h"
 
 /* Linux character device config */
 #define CDC_DEVICE_NAME					"cdc"
 #define CDC_DEVICE_CLASS				"cdc"
-#define CDC_DEVICE_CNT					1u
+/* Maximum number of CDC instances, one minor (/dev/cdcN) each */
+#define CDC_DEVICE_MAX					8u
+
+/* Register batches up to this size are handled without allocation */
+#define CDC_REG_BATCH_STACK				32u
+
+/* Number of CDC_IRQ_* types and mask of all of them */
+#define CDC_IRQ_TYPES					8u
+#define CDC_IRQ_MASK_ALL				((1u << CDC_IRQ_TYPES) - 1)
+
+/* IRQ event ring size (power of two) */
+#define CDC_EVENT_RING_SIZE				256u
+/* Events copied to user space per chunk */
+#define CDC_EVENT_READ_CHUNK			16u
+
+/* Underrun histograms: scanlines per bucket (as shift), number of scanline
+ * buckets and number of underruns-per-frame buckets (last one collects
+ * everything above) */
+#define CDC_UNDERRUN_LINE_SHIFT			5u
+#define CDC_UNDERRUN_LINE_BUCKETS		64u
+#define CDC_UNDERRUN_FRAME_BUCKETS		16u
+
+/* Underrun threshold auto-tuning: evaluation period, default warn IRQ limit
+ * per period, default step and the size of the decision history */
+#define CDC_UNDERRUN_TUNE_PERIOD_MS		1000u
+#define CDC_UNDERRUN_TUNE_WARN_LIMIT	50u
+#define CDC_UNDERRUN_TUNE_STEP			8u
+#define CDC_UNDERRUN_TUNE_HISTORY		32u
+
+/* Framebuffer address registers of a layer that pin buffers in a commit:
+ * CDC_REG_LAYER_FB_START, CDC_REG_LAYER_AUX0_FB_START and
+ * CDC_REG_LAYER_AUX1_FB_START */
+#define CDC_SCANOUT_SLOTS				3u
+
+/* mmap() page offset of allocated buffers: CDC_MMAP_BUFFER_PGOFF + handle,
+ * 16 MiB behind the register window. Handles are limited to
+ * CDC_BUFFER_HANDLE_END, so the byte offset stays below 2 GiB and fits the
+ * off_t of 32 bit user space. */
+#define CDC_MMAP_BUFFER_PGOFF			(0x1000000ul >> PAGE_SHIFT)
+#define CDC_BUFFER_HANDLE_END			\
+	((0x80000000ul >> PAGE_SHIFT) - CDC_MMAP_BUFFER_PGOFF)
+
+/* Largest allocated scanout buffer in bytes */
+#define CDC_BUFFER_SIZE_MAX				(256ul << 20)
+
+/* Default limit of the free buffer pool in KiB */
+#define CDC_BUFFER_POOL_KB				32768u
+
+/* Gamma correction technique (cdc_gamma_mode) in CDC_REG_GLOBAL_CONFIG1,
+ * see m_gamma_correction_technique of cdc_global_config */
+#define CDC_CONFIG1_GAMMA_SHIFT			11u
+#define CDC_CONFIG1_GAMMA_MASK			0x7u
+
+/* Capabilities in CDC_REG_GLOBAL_CONFIG1 (cdc_global_config) */
+#define CDC_CONFIG1_SYNC_POLARITY		0x00000010u
+#define CDC_CONFIG1_TIMING				0x00000040u
+#define CDC_CONFIG1_SHADOW				0x00000400u
+
+/* Timing registers (SYNC_SIZE, BACK_PORCH, ACTIVE_WIDTH, TOTAL_WIDTH) */
+#define CDC_MODE_TIMING_REGS			4u
+
+/* Sync, blank and clock polarity bits in CDC_REG_GLOBAL_CONTROL */
+#define CDC_CONTROL_POLARITY_MASK		(CDC_REG_GLOBAL_CONTROL_HSYNC | \
+										 CDC_REG_GLOBAL_CONTROL_VSYNC | \
+										 CDC_REG_GLOBAL_CONTROL_BLANK | \
+										 CDC_REG_GLOBAL_CONTROL_CLK_POL)
+
+/* Registers written together with a lookup table */
+#define CDC_LUT_EXTRA_MAX				2u
+/* Queued entries written in vblank between two checks of the scanline */
+#define CDC_LUT_FLUSH_CHUNK				32u
+
+/* Layer registers start behind the global register block */
+#define CDC_LAYER_REG(layer,reg)		(CDC_LAYER_SPAN * ((layer) + 1) + (reg))
+
+/* Layer registers that are never written by an atomic commit */
+#define CDC_COMMIT_LAYER_RO_MASK		((1u << CDC_REG_LAYER_CONFIG_1) | \
+										 (1u << CDC_REG_LAYER_CONFIG_2) | \
+										 (1u << CDC_REG_LAYER_RELOAD) | \
+										 (1u << CDC_REG_LAYER_CLUT))
+
+/* Simulated CDC: hardware revision reported, timer ticks per frame and
+ * shortest frame in ns (whatever the timing and pixel clock) */
+#define CDC_SIM_HW_REVISION				0x00000004u
+#define CDC_SIM_TICKS					32u
+#define CDC_SIM_FRAME_NS_MIN			1000000ull
 
 /* device tree node */
 #define CDC_OF_COMPATIBLE				"tes,cdc-1.0"
@@ -19,18 +115,357 @@
 #define CDC_IO_RREG(addr) 				ioread32(addr)
 #define CDC_IO_RADDR(base,reg)			((void*)((unsigned long)base|((unsigned long)reg)<<2))
 
+/* IRQ event ring entry. tag holds the lower 32 bits of the sequence number
+ * once the entry is complete, so readers can detect entries that were
+ * overwritten while they copied them. */
+struct cdc_event_slot
+{
+	u32 tag;
+	cdc_event event;
+};
+
+struct cdc_dev;
+
+/* in-kernel IRQ handler, the counterpart of the cdc_isr_callback slots of
+ * cdc_context. handler runs in the IRQ thread for IRQs matching mask
+ * (CDC_IRQ_* bits) and gets the matching status bits. */
+struct cdc_irq_handler
+{
+	struct list_head node;
+	unsigned int mask;
+	void (*handler)(struct cdc_dev *dev, unsigned int status, void *data);
+	void *data;
+};
+
+/* FIFO underrun telemetry (debugfs), protected by lock */
+struct cdc_underrun_stats
+{
+	spinlock_t lock;
+	struct mutex knob_lock;
+	struct cdc_irq_handler irq;
+	u64 event_tail;
+	u64 events_lost;
+	u64 warn_irqs;
+	u64 underrun_irqs;
+	u32 warn_lines[CDC_UNDERRUN_LINE_BUCKETS];
+	u32 underrun_lines[CDC_UNDERRUN_LINE_BUCKETS];
+	u32 last_position;
+	s64 last_timestamp;
+	u64 last_commit;
+	/* underrun IRQs enabled for accounting (debugfs knob) */
+	unsigned int accounting;
+	/* per frame sampling of CDC_REG_GLOBAL_UNDERRUN_COUNT */
+	unsigned int frame_sampling;
+	unsigned int hw_count_valid;
+	u32 hw_count_last;
+	u64 hw_count_total;
+	u64 frames;
+	u32 per_frame[CDC_UNDERRUN_FRAME_BUCKETS];
+};
+
+enum cdc_underrun_decision
+{
+	CDC_UNDERRUN_KEEP,
+	CDC_UNDERRUN_RAISE,
+	CDC_UNDERRUN_LOWER,
+	CDC_UNDERRUN_LIMIT
+};
+
+struct cdc_underrun_step
+{
+	s64 timestamp;
+	u32 warns;
+	u32 underruns;
+	u32 threshold;
+	enum cdc_underrun_decision decision;
+};
+
+/* closed loop control of CDC_REG_GLOBAL_UNDERRUN_THRESHOLD, protected by
+ * cdc_underrun_stats.lock (enable/disable by knob_lock) */
+struct cdc_underrun_tune
+{
+	struct delayed_work work;
+	unsigned int enabled;
+	u32 min;
+	u32 max;
+	u32 step;
+	u32 warn_limit;
+	u32 threshold;
+	u64 last_warns;
+	u64 last_underruns;
+	unsigned int history_head;
+	struct cdc_underrun_step history[CDC_UNDERRUN_TUNE_HISTORY];
+};
+
+struct cdc_file;
+
+/* buffer usable for scanout, referenced by its handle and by every layer
+ * that scans it out */
+struct cdc_buffer
+{
+	struct kref ref;
+	struct cdc_dev *dev;
+	struct cdc_file *owner;
+	/* entry in the owner's buffer list while the handle exists */
+	struct list_head file_node;
+	unsigned int handle;
+	dma_addr_t addr;
+	size_t size;
+	/* allocated buffer (dmabuf is NULL): kernel mapping and free pool
+	 * entry */
+	void *vaddr;
+	struct list_head pool_node;
+	/* imported buffer */
+	struct dma_buf *dmabuf;
+	struct dma_buf_attachment *attach;
+	struct sg_table *sgt;
+};
+
+/* buffers referenced by the framebuffer address registers of a commit.
+ * Once the commit is written they are swapped with the buffers scanned out
+ * so far, which are released when the commit was latched. */
+struct cdc_buffer_pins
+{
+	unsigned int count;
+	struct
+	{
+		unsigned int slot;
+		struct cdc_buffer *buffer;
+	} pin[];
+};
+
+/* lookup table of the CDC that is not shadowed (CLUT, ...). cache holds the
+ * hardware contents (where valid is set), next the entries to be written in
+ * the next vblank (where dirty is set). Protected by lut_slck. */
+struct cdc_lut
+{
+	struct list_head node;
+	unsigned int size;
+	unsigned int layer;
+	u32 value_mask;
+	unsigned int pending;
+	/* called with reg_slck held */
+	void (*write)(struct cdc_dev *dev, struct cdc_lut *lut,
+			unsigned int index, u32 value);
+	u32 *cache;
+	u32 *next;
+	unsigned long *valid;
+	unsigned long *dirty;
+	/* configuration registers to be written after the queued entries */
+	unsigned int extra_count;
+	cdc_reg_pair extra[CDC_LUT_EXTRA_MAX];
+};
+
+/* shadow of the CDC registers (tes_cdc_regcache.c), protected by reg_slck.
+ * While bypass is non-zero every access goes to the hardware. */
+struct cdc_regcache
+{
+	unsigned int count;
+	unsigned int bypass;
+	u32 *values;
+	unsigned long *valid;
+	u64 read_hits;
+	u64 read_misses;
+	u64 write_hits;
+	u64 write_misses;
+};
+
 struct cdc_dev
 {
 	unsigned long base_phys;
 	unsigned long span;
 	void *base_virt;
 	unsigned int irq_no;
+	unsigned int layer_count;
 	unsigned int irq_stat;
+	unsigned int irq_pending;
 	spinlock_t irq_slck;
+	spinlock_t reg_slck;
+	/* IRQ enable reference counts per CDC_IRQ_* type and the resulting
+	 * enable mask, protected by reg_slck */
+	unsigned int irq_refs[CDC_IRQ_TYPES];
+	unsigned int irq_enabled;
+	struct cdc_regcache regcache;
 	wait_queue_head_t irq_waitq;
+	/* in-kernel IRQ handlers, dispatched from the IRQ thread */
+	struct mutex irq_handler_lock;
+	struct list_head irq_handlers;
+	struct cdc_irq_handler commit_irq;
+	struct cdc_irq_handler vblank_irq;
+	/* IRQ event ring: single producer (IRQ handler), lock-free readers */
+	atomic64_t event_head;
+	struct cdc_event_slot events[CDC_EVENT_RING_SIZE];
+	/* underrun telemetry */
+	struct cdc_underrun_stats underrun;
+	struct cdc_underrun_tune underrun_tune;
+	struct dentry *debugfs;
+	/* vblank counter (line IRQ) and time of the last vblank, protected by
+	 * irq_slck */
+	u64 vblank_seq;
+	ktime_t vblank_time;
+	/* frame period measured between line IRQs, and whether the last
+	 * vblank was only estimated while the line IRQ was off */
+	s64 vblank_period;
+	bool vblank_estimated;
+	wait_queue_head_t vblank_waitq;
+	/* atomic commits: sequence of the last submitted, the last written
+	 * (armed) and the last latched commit, all protected by irq_slck */
+	struct mutex commit_lock;
+	wait_queue_head_t commit_waitq;
+	u64 commit_seq;
+	u64 commit_armed;
+	u64 commit_done;
+	/* commit that was armed when the last reload IRQ fired, the IRQ
+	 * thread retires up to this one */
+	u64 commit_reloaded;
+	struct cdc_commit_job *queued_job;
+	struct work_struct commit_work;
+	struct dma_fence *armed_fence;
+	struct cdc_buffer_pins *armed_pins;
+	spinlock_t fence_slck;
+	u64 fence_context;
+	/* lookup tables, deferred entries are written by lut_irq */
+	spinlock_t lut_slck;
+	struct list_head luts;
+	struct cdc_lut **clut;
+	struct cdc_lut *bg;
+	struct cdc_lut *gamma;
+	struct cdc_irq_handler lut_irq;
+	unsigned int lut_irq_held;
+	/* vblank counter when the first entry was queued */
+	u64 lut_seq;
+	/* writable register mappings, the copies are not trusted meanwhile */
+	unsigned int lut_mapped;
+	/* part of a mode set deferred to the next vertical blanking
+	 * (CDC_MODE_CHANGED_* bits), protected by reg_slck */
+	unsigned int mode_changed;
+	u32 mode_timing[CDC_MODE_TIMING_REGS];
+	u32 mode_polarity;
+	u64 mode_seq;
+	unsigned int mode_irq_held;
+	struct cdc_irq_handler mode_irq;
+	/* bandwidth model, protected by commit_lock */
+	u32 pixel_clock_khz;
+	u64 bw_budget;
+	/* buffer handles and the buffers scanned out per layer slot
+	 * (CDC_SCANOUT_SLOTS per layer, only touched when a commit is
+	 * written) */
+	struct mutex buffer_lock;
+	struct idr buffers;
+	struct cdc_buffer **scanout;
+	/* freed allocated buffers for reuse, protected by pool_lock */
+	struct mutex pool_lock;
+	struct list_head pool;
+	size_t pool_size;
+	/* instance number (minor) */
+	unsigned int id;
 	dev_t dev;
 	struct cdev cdev;
+	/* simulated CDC (tes_cdc_sim.c), NULL for hardware */
+	struct cdc_sim *sim;
+	/* platform device (DMA) and character device */
+	struct device *dma_dev;
 	struct device *device;
 };
 
+/* a commit on its way to the hardware. It is written immediately or, with
+ * an in-fence, from the commit work once the fence signalled. */
+struct cdc_commit_job
+{
+	struct cdc_dev *dev;
+	u64 seq;
+	struct dma_fence *in_fence;
+	struct dma_fence *out_fence;
+	struct dma_fence_cb cb;
+	struct cdc_buffer_pins *pins;
+	unsigned int count;
+	cdc_commit_layer layers[];
+};
+
+/* per open file session: every client has its own working register and
+ * register write transaction */
+struct cdc_file
+{
+	struct cdc_dev *dev;
+	unsigned int reg;
+	unsigned int irq_mask;
+	u64 event_tail;
+	u64 events_lost;
+	struct mutex txn_lock;
+	unsigned int txn_open;
+	unsigned int txn_count;
+	unsigned int txn_size;
+	cdc_reg_pair *txn;
+	/* buffers with a handle of this file, protected by buffer_lock */
+	struct list_head buffers;
+};
+
+int cdc_event_fetch(struct cdc_dev *dev, u64 *tail, u64 *lost,
+		cdc_event *event);
+void cdc_irq_get(struct cdc_dev *dev, unsigned int mask);
+void cdc_irq_put(struct cdc_dev *dev, unsigned int mask);
+void cdc_irq_add_handler(struct cdc_dev *dev, struct cdc_irq_handler *handler);
+void cdc_irq_remove_handler(struct cdc_dev *dev, struct cdc_irq_handler *handler);
+u64 cdc_vblank_get(struct cdc_dev *dev, ktime_t *time);
+bool cdc_vblank_window(struct cdc_dev *dev, u64 seq);
+int cdc_commit_layers_valid(struct cdc_dev *dev, const cdc_commit_layer *layers,
+		unsigned int count);
+
+/* tes_cdc_stats.c */
+int cdc_stats_init(struct cdc_dev *dev);
+void cdc_stats_exit(struct cdc_dev *dev);
+
+/* tes_cdc_bw.c */
+void cdc_bw_estimate(struct cdc_dev *dev, const cdc_commit_layer *layers,
+		unsigned int count, cdc_bandwidth *bw);
+int cdc_bw_admit(struct cdc_dev *dev, const cdc_commit_layer *layers,
+		unsigned int count);
+long cdc_ioctl_bandwidth(struct cdc_dev *dev, void __user *arg);
+long cdc_ioctl_bw_config(struct cdc_dev *dev, void __user *arg);
+
+/* tes_cdc_buffer.c */
+int cdc_buffer_init(struct cdc_dev *dev);
+void cdc_buffer_exit(struct cdc_dev *dev);
+void cdc_buffer_release_file(struct cdc_file *cf);
+long cdc_ioctl_buffer_import(struct cdc_file *cf, void __user *arg);
+long cdc_ioctl_buffer_release(struct cdc_file *cf, unsigned int handle);
+long cdc_ioctl_buffer_alloc(struct cdc_file *cf, void __user *arg);
+int cdc_buffer_mmap(struct cdc_file *cf, struct vm_area_struct *vma);
+
+/* tes_cdc_lut.c */
+int cdc_lut_init(struct cdc_dev *dev);
+void cdc_lut_exit(struct cdc_dev *dev);
+void cdc_lut_snoop(struct cdc_dev *dev, const cdc_reg_pair *pairs,
+		unsigned int count);
+void cdc_lut_mapped(struct cdc_dev *dev, int enable);
+long cdc_ioctl_clut_upload(struct cdc_dev *dev, void __user *arg);
+long cdc_ioctl_bg_upload(struct cdc_dev *dev, void __user *arg);
+long cdc_ioctl_gamma_upload(struct cdc_dev *dev, void __user *arg);
+int cdc_buffer_pin_commit(struct cdc_file *cf, const cdc_commit_layer *layers,
+		unsigned int count, struct cdc_buffer_pins **pins);
+void cdc_buffer_scanout(struct cdc_dev *dev, struct cdc_buffer_pins *pins);
+void cdc_buffer_unpin(struct cdc_buffer_pins *pins);
+/* tes_cdc_regcache.c */
+int cdc_regcache_init(struct cdc_dev *dev);
+void cdc_regcache_exit(struct cdc_dev *dev);
+void cdc_regcache_debugfs(struct cdc_dev *dev);
+void cdc_regcache_bypass(struct cdc_dev *dev, int enable);
+void cdc_reg_write(struct cdc_dev *dev, unsigned int reg, u32 value);
+u32 cdc_reg_read(struct cdc_dev *dev, unsigned int reg);
+u32 cdc_reg_read_single(struct cdc_dev *dev, unsigned int reg);
+/* tes_cdc_mode.c */
+long cdc_ioctl_set_mode(struct cdc_dev *dev, void __user *arg);
+void cdc_mode_irq(struct cdc_dev *dev, unsigned int status, void *data);
+
+/* tes_cdc_sim.c */
+struct platform_device;
+int cdc_sim_register(void);
+void cdc_sim_unregister(void);
+bool cdc_sim_device(struct platform_device *pdev);
+int cdc_sim_init(struct cdc_dev *dev, struct platform_device *pdev);
+void cdc_sim_exit(struct cdc_dev *dev);
+unsigned long cdc_sim_pfn(struct cdc_dev *dev);
+void cdc_sim_start(struct cdc_dev *dev);
+void cdc_sim_stop(struct cdc_dev *dev);
+
 #endif /* TES_DAVE_MODULE_H_ */
@@ -0,0 +1,234 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/bitmap.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <asm/io.h>
+#include "tes_cdc_module.h"
+#include "tes_cdc_driver.h"
+#include "cdc_base.h"
+#include "tes_cdc_trace.h"
+
+/* Register shadow cache. Writable configuration registers are kept in
+ * memory: writes of the value a register already holds are dropped and
+ * reads are served without a bus access. Status registers are always read
+ * from the CDC, registers with side effects (IRQ clear, reload, table
+ * ports) are always written. As long as the register window is mapped
+ * writable to user space the cache is bypassed. All of it runs under
+ * reg_slck. */
+
+static bool regcache = true;
+module_param(regcache, bool, 0444);
+MODULE_PARM_DESC(regcache, "Cache CDC registers (default: on)");
+
+enum cdc_reg_class
+{
+	CDC_REG_VOLATILE = 0,	/* status, always read from the CDC */
+	CDC_REG_CACHED,			/* configuration */
+	CDC_REG_CONST,			/* read-only configuration, read once */
+	CDC_REG_ACTION,			/* writes trigger something, never dropped */
+};
+
+/* unlisted (reserved) registers are volatile */
+static const u8 cdc_global_reg_class[CDC_LAYER_SPAN] = {
+	[CDC_REG_GLOBAL_HW_REVISION] = CDC_REG_CONST,
+	[CDC_REG_GLOBAL_LAYER_COUNT] = CDC_REG_CONST,
+	[CDC_REG_GLOBAL_SYNC_SIZE] = CDC_REG_CACHED,
+	[CDC_REG_GLOBAL_BACK_PORCH] = CDC_REG_CACHED,
+	[CDC_REG_GLOBAL_ACTIVE_WIDTH] = CDC_REG_CACHED,
+	[CDC_REG_GLOBAL_TOTAL_WIDTH] = CDC_REG_CACHED,
+	[CDC_REG_GLOBAL_CONTROL] = CDC_REG_CACHED,
+	[CDC_REG_GLOBAL_CONFIG1] = CDC_REG_CONST,
+	[CDC_REG_GLOBAL_CONFIG2] = CDC_REG_CONST,
+	[CDC_REG_GLOBAL_SHADOW_RELOAD] = CDC_REG_ACTION,
+	[CDC_REG_GLOBAL_GAMMA] = CDC_REG_ACTION,
+	[CDC_REG_GLOBAL_BG_COLOR] = CDC_REG_CACHED,
+	[CDC_REG_GLOBAL_IRQ_ENABLE] = CDC_REG_CACHED,
+	[CDC_REG_GLOBAL_IRQ_CLEAR] = CDC_REG_ACTION,
+	[CDC_REG_GLOBAL_LINE_IRQ_POSITION] = CDC_REG_CACHED,
+	[CDC_REG_GLOBAL_BG_LAYER_BASE] = CDC_REG_CACHED,
+	[CDC_REG_GLOBAL_BG_LAYER_INC] = CDC_REG_CACHED,
+	[CDC_REG_GLOBAL_BG_LAYER_ADDR] = CDC_REG_ACTION,
+	[CDC_REG_GLOBAL_BG_LAYER_DATA] = CDC_REG_ACTION,
+	[CDC_REG_GLOBAL_EXT_DISPLAY] = CDC_REG_CACHED,
+	[CDC_REG_GLOBAL_SECONDARY_IRQ_ENABLE] = CDC_REG_CACHED,
+	[CDC_REG_GLOBAL_SECONDARY_IRQ_CLEAR] = CDC_REG_ACTION,
+	[CDC_REG_GLOBAL_SECONDARY_LINE_IRQ_POS_CONTROL] = CDC_REG_CACHED,
+	[CDC_REG_GLOBAL_CRC_REFERENCE] = CDC_REG_CACHED,
+	[CDC_REG_GLOBAL_ROT_BUF0_START] = CDC_REG_CACHED,
+	[CDC_REG_GLOBAL_ROT_BUF1_START] = CDC_REG_CACHED,
+	[CDC_REG_GLOBAL_ROT_BUF_PITCH] = CDC_REG_CACHED,
+	[CDC_REG_GLOBAL_UNDERRUN_THRESHOLD] = CDC_REG_CACHED,
+};
+
+static const u8 cdc_layer_reg_class[CDC_LAYER_SPAN] = {
+	[CDC_REG_LAYER_CONFIG_1] = CDC_REG_CONST,
+	[CDC_REG_LAYER_CONFIG_2] = CDC_REG_CONST,
+	[CDC_REG_LAYER_RELOAD] = CDC_REG_ACTION,
+	[CDC_REG_LAYER_CONTROL ... CDC_REG_LAYER_AUX_FB_LINES] = CDC_REG_CACHED,
+	[CDC_REG_LAYER_CLUT] = CDC_REG_ACTION,
+	[CDC_REG_LAYER_SCALER_INPUT_SIZE ... CDC_REG_LAYER_YCBCR_SCALE_2] =
+		CDC_REG_CACHED,
+};
+
+static unsigned int cdc_reg_class(struct cdc_dev *dev, unsigned int reg)
+{
+	if(reg < CDC_LAYER_SPAN)
+		return cdc_global_reg_class[reg];
+	if(reg / CDC_LAYER_SPAN - 1 < dev->layer_count)
+		return cdc_layer_reg_class[reg % CDC_LAYER_SPAN];
+
+	return CDC_REG_VOLATILE;
+}
+
+void cdc_reg_write(struct cdc_dev *dev, unsigned int reg, u32 value)
+{
+	struct cdc_regcache *rc = &dev->regcache;
+	unsigned int class = cdc_reg_class(dev, reg);
+
+	lockdep_assert_held(&dev->reg_slck);
+
+	if(class == CDC_REG_CACHED && !rc->bypass)
+	{
+		if(test_bit(reg, rc->valid) && rc->values[reg] == value)
+		{
+			rc->write_hits++;
+			trace_cdc_reg_write(dev, reg, value, true);
+			return;
+		}
+		rc->write_misses++;
+	}
+
+	trace_cdc_reg_write(dev, reg, value, false);
+	CDC_IO_WREG(CDC_IO_RADDR(dev->base_virt, reg), value);
+
+	if(class != CDC_REG_CACHED || rc->bypass)
+		return;
+
+	/* a single frame trigger is not part of the configuration */
+	if(reg == CDC_REG_GLOBAL_CONTROL)
+		value &= ~CDC_REG_GLOBAL_CONTROL_SF_TRG;
+	rc->values[reg] = value;
+	__set_bit(reg, rc->valid);
+}
+
+u32 cdc_reg_read(struct cdc_dev *dev, unsigned int reg)
+{
+	struct cdc_regcache *rc = &dev->regcache;
+	unsigned int class = cdc_reg_class(dev, reg);
+	u32 value;
+
+	lockdep_assert_held(&dev->reg_slck);
+
+	if(class == CDC_REG_VOLATILE || class == CDC_REG_ACTION || rc->bypass)
+	{
+		value = CDC_IO_RREG(CDC_IO_RADDR(dev->base_virt, reg));
+		trace_cdc_reg_read(dev, reg, value, false);
+		return value;
+	}
+
+	if(test_bit(reg, rc->valid))
+	{
+		rc->read_hits++;
+		trace_cdc_reg_read(dev, reg, rc->values[reg], true);
+		return rc->values[reg];
+	}
+
+	rc->read_misses++;
+	value = CDC_IO_RREG(CDC_IO_RADDR(dev->base_virt, reg));
+	rc->values[reg] = value;
+	__set_bit(reg, rc->valid);
+	trace_cdc_reg_read(dev, reg, value, false);
+
+	return value;
+}
+
+/* a single read, for callers not holding reg_slck */
+u32 cdc_reg_read_single(struct cdc_dev *dev, unsigned int reg)
+{
+	unsigned long flags;
+	u32 value;
+
+	spin_lock_irqsave(&dev->reg_slck, flags);
+	value = cdc_reg_read(dev, reg);
+	spin_unlock_irqrestore(&dev->reg_slck, flags);
+
+	return value;
+}
+
+/* writable register mappings: the registers can change behind the driver's
+ * back, so the cache is dropped and bypassed while they exist */
+void cdc_regcache_bypass(struct cdc_dev *dev, int enable)
+{
+	struct cdc_regcache *rc = &dev->regcache;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->reg_slck, flags);
+	if(enable)
+		rc->bypass++;
+	else if(!WARN_ON(!rc->bypass))
+		rc->bypass--;
+	bitmap_zero(rc->valid, rc->count);
+	spin_unlock_irqrestore(&dev->reg_slck, flags);
+}
+
+static int cdc_regcache_show(struct seq_file *s, void *unused)
+{
+	struct cdc_dev *dev = s->private;
+	struct cdc_regcache *rc = &dev->regcache;
+	struct cdc_regcache copy;
+	unsigned int cached;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->reg_slck, flags);
+	copy = *rc;
+	cached = bitmap_weight(rc->valid, rc->count);
+	spin_unlock_irqrestore(&dev->reg_slck, flags);
+
+	seq_printf(s, "enabled: %u\n", regcache);
+	seq_printf(s, "bypass: %u\n", copy.bypass);
+	seq_printf(s, "cached_registers: %u\n", cached);
+	seq_printf(s, "read_hits: %llu\n", copy.read_hits);
+	seq_printf(s, "read_misses: %llu\n", copy.read_misses);
+	seq_printf(s, "write_hits: %llu\n", copy.write_hits);
+	seq_printf(s, "write_misses: %llu\n", copy.write_misses);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(cdc_regcache);
+
+void cdc_regcache_debugfs(struct cdc_dev *dev)
+{
+	debugfs_create_file("regcache", S_IRUGO, dev->debugfs, dev,
+			&cdc_regcache_fops);
+}
+
+int cdc_regcache_init(struct cdc_dev *dev)
+{
+	struct cdc_regcache *rc = &dev->regcache;
+
+	/* every valid register index, see cdc_reg_valid() */
+	rc->count = (dev->span >> 2) + 1;
+	rc->values = kcalloc(rc->count, sizeof(*rc->values), GFP_KERNEL);
+	rc->valid = kcalloc(BITS_TO_LONGS(rc->count), sizeof(*rc->valid),
+			GFP_KERNEL);
+	if(!rc->values || !rc->valid)
+	{
+		cdc_regcache_exit(dev);
+		return -ENOMEM;
+	}
+
+	/* disabled: bypassed for good */
+	rc->bypass = !regcache;
+
+	return 0;
+}
+
+void cdc_regcache_exit(struct cdc_dev *dev)
+{
+	kfree(dev->regcache.values);
+	kfree(dev->regcache.valid);
+	dev->regcache.values = NULL;
+	dev->regcache.valid = NULL;
+}
@@ -0,0 +1,314 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/hrtimer.h>
+#include <linux/irq_sim.h>
+#include <linux/platform_device.h>
+#include <linux/math64.h>
+#include <asm/io.h>
+#include "tes_cdc_module.h"
+#include "tes_cdc_driver.h"
+#include "cdc_base.h"
+
+/* Software model of the CDC for testing and benchmarking without hardware.
+ * The registers live in ordinary memory that the driver accesses like the
+ * MMIO window. An hrtimer advances the scan position with the programmed
+ * timing and raises the line and reload IRQs through a simulated interrupt
+ * line. Global registers take effect at once, a layer block is latched on
+ * a shadow reload or a reload of that layer. Bus accesses and pixel
+ * fetching are not modelled. */
+
+static unsigned int sim;
+module_param(sim, uint, 0444);
+MODULE_PARM_DESC(sim, "Number of simulated CDCs to register (default: 0)");
+
+static unsigned int sim_layers = 2;
+module_param(sim_layers, uint, 0444);
+MODULE_PARM_DESC(sim_layers, "Layers of the simulated CDC (default: 2)");
+
+static unsigned int sim_pixel_clock_khz = 25175;
+module_param(sim_pixel_clock_khz, uint, 0444);
+MODULE_PARM_DESC(sim_pixel_clock_khz,
+		"Pixel clock of the simulated CDC in kHz (default: 25175)");
+
+struct cdc_sim
+{
+	struct cdc_dev *dev;
+	u32 *regs;
+	unsigned int order;
+	struct irq_sim irq;
+	struct hrtimer timer;
+	/* layer blocks in effect since their last reload */
+	u32 *layers;
+	unsigned int layer_count;
+	ktime_t frame_start;
+	u32 line;
+};
+
+static struct platform_device *cdc_sim_pdev[CDC_DEVICE_MAX];
+
+/* power-on timing: VGA 640x480, 60 Hz at 25.175 MHz. Horizontal values
+ * are in the upper, vertical values in the lower half, accumulated from
+ * the sync pulse on and stored minus one. */
+static const cdc_reg_pair cdc_sim_reset[] = {
+	{ CDC_REG_GLOBAL_SYNC_SIZE, (95 << 16) | 1 },
+	{ CDC_REG_GLOBAL_BACK_PORCH, (143 << 16) | 34 },
+	{ CDC_REG_GLOBAL_ACTIVE_WIDTH, (783 << 16) | 514 },
+	{ CDC_REG_GLOBAL_TOTAL_WIDTH, (799 << 16) | 524 },
+	{ CDC_REG_GLOBAL_CONTROL, CDC_REG_GLOBAL_CONTROL_ENABLE },
+	{ CDC_REG_GLOBAL_CONFIG1, CDC_CONFIG1_SYNC_POLARITY | CDC_CONFIG1_TIMING |
+		CDC_CONFIG1_SHADOW | CDC_GAMMA_MODE_RAM << CDC_CONFIG1_GAMMA_SHIFT },
+	{ CDC_REG_GLOBAL_LINE_IRQ_POSITION, 515 },
+};
+
+bool cdc_sim_device(struct platform_device *pdev)
+{
+	unsigned int i;
+
+	for(i = 0; i < CDC_DEVICE_MAX; i++)
+	{
+		if(cdc_sim_pdev[i] && pdev == cdc_sim_pdev[i])
+			return true;
+	}
+
+	return false;
+}
+
+/* latch the layer blocks whose reload or the shadow reload requests one
+ * of the reload bits in mask. Returns true if a reload took place. */
+static bool cdc_sim_reload(struct cdc_sim *cs, u32 mask)
+{
+	bool shadow = cs->regs[CDC_REG_GLOBAL_SHADOW_RELOAD] & mask;
+	bool reloaded = shadow;
+	u32 *reload;
+	unsigned int l;
+
+	for(l = 0; l < cs->layer_count; l++)
+	{
+		reload = &cs->regs[CDC_LAYER_REG(l, CDC_REG_LAYER_RELOAD)];
+		if(!shadow && !(*reload & mask))
+			continue;
+
+		memcpy(&cs->layers[l * CDC_LAYER_SPAN],
+				&cs->regs[CDC_LAYER_REG(l, 0)],
+				CDC_LAYER_SPAN * sizeof(u32));
+		*reload = 0;
+		reloaded = true;
+	}
+
+	if(shadow)
+		cs->regs[CDC_REG_GLOBAL_SHADOW_RELOAD] = 0;
+
+	return reloaded;
+}
+
+static u64 cdc_sim_frame_ns(struct cdc_sim *cs, u32 *width, u32 *height)
+{
+	u32 total = READ_ONCE(cs->regs[CDC_REG_GLOBAL_TOTAL_WIDTH]);
+	u32 pixel_clock_khz;
+
+	*width = (total >> 16) + 1;
+	*height = (total & 0xffff) + 1;
+
+	/* a pixel clock set by a mode set or the bandwidth config wins */
+	pixel_clock_khz = READ_ONCE(cs->dev->pixel_clock_khz);
+	if(!pixel_clock_khz)
+		pixel_clock_khz = max(sim_pixel_clock_khz, 1u);
+
+	return max(div_u64((u64) *width * *height * 1000000, pixel_clock_khz),
+			CDC_SIM_FRAME_NS_MIN);
+}
+
+static enum hrtimer_restart cdc_sim_tick(struct hrtimer *timer)
+{
+	struct cdc_sim *cs = container_of(timer, struct cdc_sim, timer);
+	u32 *regs = cs->regs;
+	u32 width, height, line, target, raise = 0;
+	u64 frame_ns, period, elapsed, frames;
+	unsigned int shift;
+	bool wrapped = false;
+	u32 status;
+
+	/* IRQ_CLEAR is consumed here, IRQ_STATUS only written here */
+	status = regs[CDC_REG_GLOBAL_IRQ_STATUS] &
+		~xchg(&regs[CDC_REG_GLOBAL_IRQ_CLEAR], 0);
+
+	frame_ns = cdc_sim_frame_ns(cs, &width, &height);
+	elapsed = ktime_to_ns(ktime_sub(hrtimer_cb_get_time(timer),
+				cs->frame_start));
+	if(elapsed >= frame_ns)
+	{
+		/* vertical blanking passed: shadow reload and a new frame */
+		frames = div64_u64(elapsed, frame_ns);
+		cs->frame_start = ktime_add_ns(cs->frame_start, frames * frame_ns);
+		elapsed -= frames * frame_ns;
+		wrapped = true;
+
+		if(cdc_sim_reload(cs, CDC_REG_GLOBAL_SHADOW_RELOAD_VBLANK))
+			raise |= CDC_IRQ_RELOAD;
+	}
+
+	if(cdc_sim_reload(cs, CDC_REG_GLOBAL_SHADOW_RELOAD_IMMEDIATE))
+		raise |= CDC_IRQ_RELOAD;
+
+	/* scanline and column, line IRQ when the programmed line was passed.
+	 * Long frames are scaled down to keep the products within 64 bits
+	 * (the totals have 16 bits), elapsed stays below the period. */
+	shift = max(fls64(frame_ns), 47) - 47;
+	period = ((frame_ns - 1) >> shift) + 1;
+	elapsed = (elapsed >> shift) * height;
+	line = div64_u64(elapsed, period);
+	regs[CDC_REG_GLOBAL_POSITION] = (line << 16) |
+		(u32) div64_u64((elapsed - line * period) * width, period);
+
+	target = regs[CDC_REG_GLOBAL_LINE_IRQ_POSITION] & 0xffff;
+	if(wrapped ? (target > cs->line || target <= line) :
+			(target > cs->line && target <= line))
+		raise |= CDC_IRQ_LINE;
+	cs->line = line;
+
+	/* only enabled IRQs are latched */
+	status |= raise & regs[CDC_REG_GLOBAL_IRQ_ENABLE];
+	regs[CDC_REG_GLOBAL_IRQ_STATUS] = status;
+	if(status & regs[CDC_REG_GLOBAL_IRQ_ENABLE])
+		irq_sim_fire(&cs->irq, 0);
+
+	hrtimer_forward_now(timer, ns_to_ktime(max(div_u64(frame_ns,
+						CDC_SIM_TICKS), 1000ull)));
+
+	return HRTIMER_RESTART;
+}
+
+/* called by probe instead of the device tree and MMIO setup */
+int cdc_sim_init(struct cdc_dev *dev, struct platform_device *pdev)
+{
+	struct cdc_sim *cs;
+	unsigned int i;
+	int result;
+
+	if(!sim_layers)
+		return -EINVAL;
+
+	cs = devm_kzalloc(&pdev->dev, sizeof(*cs), GFP_KERNEL);
+	if(!cs)
+		return -ENOMEM;
+	cs->dev = dev;
+	cs->layer_count = sim_layers;
+
+	cs->layers = devm_kcalloc(&pdev->dev, sim_layers * CDC_LAYER_SPAN,
+			sizeof(u32), GFP_KERNEL);
+	if(!cs->layers)
+		return -ENOMEM;
+
+	/* one global block and one block per layer. CDC_IO_RADDR() ors the
+	 * register offset into the base, the pages are aligned to their
+	 * order. */
+	dev->span = CDC_LAYER_SPAN * (sim_layers + 1) * sizeof(u32) - 1;
+	cs->order = get_order(dev->span + 1);
+	cs->regs = (u32 *) __get_free_pages(GFP_KERNEL | __GFP_ZERO, cs->order);
+	if(!cs->regs)
+		return -ENOMEM;
+
+	result = devm_irq_sim_init(&pdev->dev, &cs->irq, 1);
+	if(result)
+	{
+		free_pages((unsigned long) cs->regs, cs->order);
+		return result;
+	}
+
+	cs->regs[CDC_REG_GLOBAL_HW_REVISION] = CDC_SIM_HW_REVISION;
+	cs->regs[CDC_REG_GLOBAL_LAYER_COUNT] = sim_layers;
+	for(i = 0; i < ARRAY_SIZE(cdc_sim_reset); i++)
+		cs->regs[cdc_sim_reset[i].reg] = cdc_sim_reset[i].value;
+	memcpy(cs->layers, &cs->regs[CDC_LAYER_REG(0, 0)],
+			sim_layers * CDC_LAYER_SPAN * sizeof(u32));
+
+	hrtimer_init(&cs->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	cs->timer.function = cdc_sim_tick;
+
+	dev->sim = cs;
+	dev->base_virt = cs->regs;
+	/* there is no bus address, and a kernel one is not reported */
+	dev->base_phys = 0;
+	dev->irq_no = irq_sim_irqnum(&cs->irq, 0);
+	dev_info(&pdev->dev, "simulated CDC with %u layers, pixel clock %u kHz\n",
+			sim_layers, sim_pixel_clock_khz);
+
+	return 0;
+}
+
+/* page frame of the register memory for cdc_mmap() */
+unsigned long cdc_sim_pfn(struct cdc_dev *dev)
+{
+	return virt_to_phys(dev->sim->regs) >> PAGE_SHIFT;
+}
+
+void cdc_sim_exit(struct cdc_dev *dev)
+{
+	struct cdc_sim *cs = dev->sim;
+
+	free_pages((unsigned long) cs->regs, cs->order);
+}
+
+/* the IRQ handler has to be registered before the scan starts */
+void cdc_sim_start(struct cdc_dev *dev)
+{
+	struct cdc_sim *cs = dev->sim;
+
+	cs->frame_start = ktime_get();
+	cs->line = 0;
+	hrtimer_start(&cs->timer, ns_to_ktime(0), HRTIMER_MODE_REL);
+}
+
+void cdc_sim_stop(struct cdc_dev *dev)
+{
+	hrtimer_cancel(&dev->sim->timer);
+}
+
+/* module init/exit: the simulated CDCs bind to the driver by name. Adding
+ * a device probes it right away, so it is marked as simulated before. */
+int cdc_sim_register(void)
+{
+	struct platform_device *pdev;
+	unsigned int i;
+	int result;
+
+	for(i = 0; i < min(sim, CDC_DEVICE_MAX); i++)
+	{
+		pdev = platform_device_alloc(CDC_DEVICE_NAME, i);
+		if(!pdev)
+		{
+			result = -ENOMEM;
+			goto FAILED;
+		}
+
+		cdc_sim_pdev[i] = pdev;
+		result = platform_device_add(pdev);
+		if(result)
+		{
+			cdc_sim_pdev[i] = NULL;
+			platform_device_put(pdev);
+			goto FAILED;
+		}
+	}
+
+	return 0;
+
+FAILED:
+	cdc_sim_unregister();
+
+	return result;
+}
+
+void cdc_sim_unregister(void)
+{
+	unsigned int i;
+
+	for(i = 0; i < CDC_DEVICE_MAX; i++)
+	{
+		if(cdc_sim_pdev[i])
+			platform_device_unregister(cdc_sim_pdev[i]);
+		cdc_sim_pdev[i] = NULL;
+	}
+}
@@ -0,0 +1,613 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/workqueue.h>
+#include <linux/slab.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <asm/io.h>
+#include "tes_cdc_module.h"
+#include "tes_cdc_driver.h"
+#include "cdc_base.h"
+
+/* FIFO underrun telemetry. The IRQ thread walks the event ring, so every
+ * underrun is accounted with the scanline it happened in, even if several
+ * IRQs were handled in one go. With frame sampling enabled the hardware
+ * underrun counter is additionally sampled on every line IRQ (once per
+ * frame) to build a histogram of underruns per frame. The underrun IRQs
+ * are enabled while accounting (on by default) or auto-tuning is on; a
+ * threshold set too low raises the warn IRQ in every frame. Frame sampling
+ * keeps the line IRQ enabled in every frame, so it has to be asked for. */
+
+#define CDC_UNDERRUN_IRQS (CDC_IRQ_FIFO_UNDERRUN_WARN | CDC_IRQ_FIFO_UNDERRUN)
+
+static bool underrun_accounting = true;
+module_param(underrun_accounting, bool, 0444);
+MODULE_PARM_DESC(underrun_accounting,
+		"Account FIFO underrun IRQs from probe on (default: on)");
+
+static bool underrun_frame_sampling;
+module_param(underrun_frame_sampling, bool, 0444);
+MODULE_PARM_DESC(underrun_frame_sampling,
+		"Sample the hardware underrun counter every frame from probe on, "
+		"keeps the line IRQ enabled (default: off)");
+
+static bool underrun_autotune;
+module_param(underrun_autotune, bool, 0444);
+MODULE_PARM_DESC(underrun_autotune,
+		"Adjust the FIFO underrun threshold at runtime (default: off)");
+
+static unsigned int cdc_stats_line_bucket(unsigned int position)
+{
+	/* the scanline is the upper half of the position register */
+	return min((position >> 16) >> CDC_UNDERRUN_LINE_SHIFT,
+			CDC_UNDERRUN_LINE_BUCKETS - 1);
+}
+
+static void cdc_stats_sample_frame(struct cdc_dev *dev)
+{
+	struct cdc_underrun_stats *st = &dev->underrun;
+	u32 count, delta;
+
+	count = CDC_IO_RREG(CDC_IO_RADDR(dev->base_virt,
+				CDC_REG_GLOBAL_UNDERRUN_COUNT));
+	delta = count - st->hw_count_last;
+	st->hw_count_last = count;
+
+	/* the first sample only establishes the reference */
+	if(!st->hw_count_valid)
+	{
+		st->hw_count_valid = 1;
+		return;
+	}
+
+	st->hw_count_total += delta;
+	st->frames++;
+	st->per_frame[min(delta, CDC_UNDERRUN_FRAME_BUCKETS - 1)]++;
+}
+
+static void cdc_stats_irq(struct cdc_dev *dev, unsigned int status, void *data)
+{
+	struct cdc_underrun_stats *st = &dev->underrun;
+	cdc_event event;
+	unsigned int bucket;
+	unsigned long flags;
+	u64 lost = 0;
+
+	spin_lock(&st->lock);
+	while(cdc_event_fetch(dev, &st->event_tail, &lost, &event))
+	{
+		bucket = cdc_stats_line_bucket(event.position);
+
+		if(event.status & CDC_IRQ_FIFO_UNDERRUN_WARN)
+		{
+			st->warn_irqs++;
+			st->warn_lines[bucket]++;
+		}
+
+		if(event.status & CDC_IRQ_FIFO_UNDERRUN)
+		{
+			st->underrun_irqs++;
+			st->underrun_lines[bucket]++;
+			st->last_position = event.position;
+			st->last_timestamp = event.timestamp;
+			spin_lock_irqsave(&dev->irq_slck, flags);
+			st->last_commit = dev->commit_done;
+			spin_unlock_irqrestore(&dev->irq_slck, flags);
+		}
+
+		if((event.status & CDC_IRQ_LINE) && st->frame_sampling)
+			cdc_stats_sample_frame(dev);
+	}
+	st->events_lost += lost;
+	spin_unlock(&st->lock);
+}
+
+static void cdc_stats_show_histogram(struct seq_file *s, const char *name,
+		const u32 *hist, unsigned int buckets, unsigned int shift)
+{
+	unsigned int i;
+
+	seq_printf(s, "%s:\n", name);
+	for(i = 0; i < buckets; i++)
+	{
+		if(hist[i])
+			seq_printf(s, "  %5u-%5u: %u\n", i << shift,
+					((i + 1) << shift) - 1, hist[i]);
+	}
+}
+
+static int cdc_stats_underrun_show(struct seq_file *s, void *unused)
+{
+	struct cdc_dev *dev = s->private;
+	struct cdc_underrun_stats *st = &dev->underrun;
+	struct cdc_underrun_stats *copy;
+	unsigned int i;
+
+	/* print from a snapshot, seq_printf may sleep */
+	copy = kmalloc(sizeof(*copy), GFP_KERNEL);
+	if(!copy)
+		return -ENOMEM;
+
+	spin_lock(&st->lock);
+	memcpy(copy, st, sizeof(*copy));
+	spin_unlock(&st->lock);
+
+	seq_printf(s, "underrun_warn_irqs: %llu\n", copy->warn_irqs);
+	seq_printf(s, "underrun_irqs: %llu\n", copy->underrun_irqs);
+	seq_printf(s, "events_lost: %llu\n", copy->events_lost);
+	seq_printf(s, "last_underrun_line: %u\n", copy->last_position >> 16);
+	seq_printf(s, "last_underrun_time_ns: %lld\n", copy->last_timestamp);
+	seq_printf(s, "last_underrun_commit: %llu\n", copy->last_commit);
+	seq_printf(s, "sampled_frames: %llu\n", copy->frames);
+	seq_printf(s, "sampled_hw_underruns: %llu\n", copy->hw_count_total);
+
+	cdc_stats_show_histogram(s, "warn_lines", copy->warn_lines,
+			CDC_UNDERRUN_LINE_BUCKETS, CDC_UNDERRUN_LINE_SHIFT);
+	cdc_stats_show_histogram(s, "underrun_lines", copy->underrun_lines,
+			CDC_UNDERRUN_LINE_BUCKETS, CDC_UNDERRUN_LINE_SHIFT);
+
+	seq_puts(s, "underruns_per_frame:\n");
+	for(i = 0; i < CDC_UNDERRUN_FRAME_BUCKETS; i++)
+	{
+		if(copy->per_frame[i])
+			seq_printf(s, "  %s%2u: %u\n",
+					i == CDC_UNDERRUN_FRAME_BUCKETS - 1 ? ">=" : "  ",
+					i, copy->per_frame[i]);
+	}
+
+	kfree(copy);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(cdc_stats_underrun);
+
+/* frame sampling needs the line IRQ in every frame, so it is off by default */
+static int cdc_stats_sampling_get(void *data, u64 *val)
+{
+	struct cdc_dev *dev = data;
+
+	*val = dev->underrun.frame_sampling;
+
+	return 0;
+}
+
+static int cdc_stats_sampling_set(void *data, u64 val)
+{
+	struct cdc_dev *dev = data;
+	struct cdc_underrun_stats *st = &dev->underrun;
+	unsigned int enable = !!val;
+
+	mutex_lock(&st->knob_lock);
+	if(enable != st->frame_sampling)
+	{
+		if(enable)
+			cdc_irq_get(dev, CDC_IRQ_LINE);
+
+		spin_lock(&st->lock);
+		st->frame_sampling = enable;
+		st->hw_count_valid = 0;
+		spin_unlock(&st->lock);
+
+		if(!enable)
+			cdc_irq_put(dev, CDC_IRQ_LINE);
+	}
+	mutex_unlock(&st->knob_lock);
+
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(cdc_stats_sampling_fops, cdc_stats_sampling_get,
+		cdc_stats_sampling_set, "%llu\n");
+
+static void cdc_stats_accounting_enable(struct cdc_dev *dev,
+		unsigned int enable)
+{
+	struct cdc_underrun_stats *st = &dev->underrun;
+
+	mutex_lock(&st->knob_lock);
+	if(enable != st->accounting)
+	{
+		if(enable)
+			cdc_irq_get(dev, CDC_UNDERRUN_IRQS);
+		else
+			cdc_irq_put(dev, CDC_UNDERRUN_IRQS);
+		st->accounting = enable;
+	}
+	mutex_unlock(&st->knob_lock);
+}
+
+static int cdc_stats_accounting_get(void *data, u64 *val)
+{
+	struct cdc_dev *dev = data;
+
+	*val = dev->underrun.accounting;
+
+	return 0;
+}
+
+static int cdc_stats_accounting_set(void *data, u64 val)
+{
+	cdc_stats_accounting_enable(data, !!val);
+
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(cdc_stats_accounting_fops, cdc_stats_accounting_get,
+		cdc_stats_accounting_set, "%llu\n");
+
+static int cdc_stats_reset_set(void *data, u64 val)
+{
+	struct cdc_dev *dev = data;
+	struct cdc_underrun_stats *st = &dev->underrun;
+
+	spin_lock(&st->lock);
+	st->warn_irqs = 0;
+	st->underrun_irqs = 0;
+	st->events_lost = 0;
+	st->frames = 0;
+	st->hw_count_total = 0;
+	st->hw_count_valid = 0;
+	memset(st->warn_lines, 0, sizeof(st->warn_lines));
+	memset(st->underrun_lines, 0, sizeof(st->underrun_lines));
+	memset(st->per_frame, 0, sizeof(st->per_frame));
+	spin_unlock(&st->lock);
+
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(cdc_stats_reset_fops, NULL, cdc_stats_reset_set,
+		"%llu\n");
+
+/* Threshold auto-tuning. Every period the warn and underrun IRQs seen since
+ * the last period are evaluated: a real underrun raises the threshold by one
+ * step (warn earlier), more warnings than warn_limit lower it by one step.
+ * The threshold is kept within [min, max]. Only changes and hits of the
+ * bounds are recorded in the history. */
+static void cdc_stats_tune_record(struct cdc_underrun_tune *tune, u32 warns,
+		u32 underruns, enum cdc_underrun_decision decision)
+{
+	struct cdc_underrun_step *step;
+
+	step = &tune->history[tune->history_head % CDC_UNDERRUN_TUNE_HISTORY];
+	step->timestamp = ktime_to_ns(ktime_get());
+	step->warns = warns;
+	step->underruns = underruns;
+	step->threshold = tune->threshold;
+	step->decision = decision;
+	tune->history_head++;
+}
+
+static void cdc_stats_tune_write(struct cdc_dev *dev, u32 threshold)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->reg_slck, flags);
+	cdc_reg_write(dev, CDC_REG_GLOBAL_UNDERRUN_THRESHOLD, threshold);
+	spin_unlock_irqrestore(&dev->reg_slck, flags);
+}
+
+static void cdc_stats_tune_work(struct work_struct *work)
+{
+	struct cdc_underrun_tune *tune = container_of(to_delayed_work(work),
+			struct cdc_underrun_tune, work);
+	struct cdc_dev *dev = container_of(tune, struct cdc_dev, underrun_tune);
+	struct cdc_underrun_stats *st = &dev->underrun;
+	enum cdc_underrun_decision decision = CDC_UNDERRUN_KEEP;
+	u64 warns, underruns;
+	u32 threshold;
+
+	spin_lock(&st->lock);
+	if(!tune->enabled)
+	{
+		spin_unlock(&st->lock);
+		return;
+	}
+
+	/* counters may have been reset in between */
+	warns = st->warn_irqs >= tune->last_warns ?
+		st->warn_irqs - tune->last_warns : st->warn_irqs;
+	underruns = st->underrun_irqs >= tune->last_underruns ?
+		st->underrun_irqs - tune->last_underruns : st->underrun_irqs;
+	tune->last_warns = st->warn_irqs;
+	tune->last_underruns = st->underrun_irqs;
+
+	threshold = tune->threshold;
+	if(underruns)
+	{
+		if(threshold < tune->max)
+		{
+			threshold = min(threshold + tune->step, tune->max);
+			decision = CDC_UNDERRUN_RAISE;
+		}
+		else
+			decision = CDC_UNDERRUN_LIMIT;
+	}
+	else if(warns > tune->warn_limit)
+	{
+		if(threshold > tune->min)
+		{
+			threshold = threshold > tune->min + tune->step ?
+				threshold - tune->step : tune->min;
+			decision = CDC_UNDERRUN_LOWER;
+		}
+		else
+			decision = CDC_UNDERRUN_LIMIT;
+	}
+
+	if(threshold != tune->threshold)
+	{
+		tune->threshold = threshold;
+		cdc_stats_tune_write(dev, threshold);
+	}
+
+	if(decision != CDC_UNDERRUN_KEEP)
+		cdc_stats_tune_record(tune, min_t(u64, warns, U32_MAX),
+				min_t(u64, underruns, U32_MAX), decision);
+	spin_unlock(&st->lock);
+
+	schedule_delayed_work(&tune->work,
+			msecs_to_jiffies(CDC_UNDERRUN_TUNE_PERIOD_MS));
+}
+
+static void cdc_stats_tune_enable(struct cdc_dev *dev, unsigned int enable)
+{
+	struct cdc_underrun_stats *st = &dev->underrun;
+	struct cdc_underrun_tune *tune = &dev->underrun_tune;
+	u32 threshold;
+
+	mutex_lock(&st->knob_lock);
+	if(enable == tune->enabled)
+		goto OUT;
+
+	if(!enable)
+	{
+		spin_lock(&st->lock);
+		tune->enabled = 0;
+		spin_unlock(&st->lock);
+		cancel_delayed_work_sync(&tune->work);
+		cdc_irq_put(dev, CDC_UNDERRUN_IRQS);
+		goto OUT;
+	}
+
+	/* the decisions are based on the underrun IRQs */
+	cdc_irq_get(dev, CDC_UNDERRUN_IRQS);
+
+	/* start from the current (hand tuned) setting within the bounds */
+	threshold = cdc_reg_read_single(dev, CDC_REG_GLOBAL_UNDERRUN_THRESHOLD);
+
+	spin_lock(&st->lock);
+	tune->threshold = clamp(threshold, tune->min, tune->max);
+	tune->last_warns = st->warn_irqs;
+	tune->last_underruns = st->underrun_irqs;
+	tune->enabled = 1;
+	if(tune->threshold != threshold)
+		cdc_stats_tune_write(dev, tune->threshold);
+	cdc_stats_tune_record(tune, 0, 0, CDC_UNDERRUN_KEEP);
+	spin_unlock(&st->lock);
+
+	schedule_delayed_work(&tune->work,
+			msecs_to_jiffies(CDC_UNDERRUN_TUNE_PERIOD_MS));
+
+OUT:
+	mutex_unlock(&st->knob_lock);
+}
+
+static int cdc_stats_tune_get(void *data, u64 *val)
+{
+	struct cdc_dev *dev = data;
+
+	*val = dev->underrun_tune.enabled;
+
+	return 0;
+}
+
+static int cdc_stats_tune_set(void *data, u64 val)
+{
+	cdc_stats_tune_enable(data, !!val);
+
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(cdc_stats_tune_fops, cdc_stats_tune_get,
+		cdc_stats_tune_set, "%llu\n");
+
+/* bounds and step of the tuner, changed under its lock and only to a
+ * consistent set (min <= max, step >= 1). A running tuner moves its
+ * threshold into the new bounds at once. */
+static int cdc_stats_tune_bound_set(struct cdc_dev *dev, u32 *bound, u64 val)
+{
+	struct cdc_underrun_stats *st = &dev->underrun;
+	struct cdc_underrun_tune *tune = &dev->underrun_tune;
+	u32 old, threshold;
+	int ret = 0;
+
+	if(val > U16_MAX)
+		return -EINVAL;
+
+	mutex_lock(&st->knob_lock);
+	spin_lock(&st->lock);
+	old = *bound;
+	*bound = val;
+	if(tune->min > tune->max || !tune->step)
+	{
+		*bound = old;
+		ret = -EINVAL;
+	}
+	else if(tune->enabled)
+	{
+		threshold = clamp(tune->threshold, tune->min, tune->max);
+		if(threshold != tune->threshold)
+		{
+			tune->threshold = threshold;
+			cdc_stats_tune_write(dev, threshold);
+		}
+	}
+	spin_unlock(&st->lock);
+	mutex_unlock(&st->knob_lock);
+
+	return ret;
+}
+
+static int cdc_stats_tune_min_get(void *data, u64 *val)
+{
+	struct cdc_dev *dev = data;
+
+	*val = READ_ONCE(dev->underrun_tune.min);
+
+	return 0;
+}
+
+static int cdc_stats_tune_min_set(void *data, u64 val)
+{
+	struct cdc_dev *dev = data;
+
+	return cdc_stats_tune_bound_set(dev, &dev->underrun_tune.min, val);
+}
+DEFINE_DEBUGFS_ATTRIBUTE(cdc_stats_tune_min_fops, cdc_stats_tune_min_get,
+		cdc_stats_tune_min_set, "%llu\n");
+
+static int cdc_stats_tune_max_get(void *data, u64 *val)
+{
+	struct cdc_dev *dev = data;
+
+	*val = READ_ONCE(dev->underrun_tune.max);
+
+	return 0;
+}
+
+static int cdc_stats_tune_max_set(void *data, u64 val)
+{
+	struct cdc_dev *dev = data;
+
+	return cdc_stats_tune_bound_set(dev, &dev->underrun_tune.max, val);
+}
+DEFINE_DEBUGFS_ATTRIBUTE(cdc_stats_tune_max_fops, cdc_stats_tune_max_get,
+		cdc_stats_tune_max_set, "%llu\n");
+
+static int cdc_stats_tune_step_get(void *data, u64 *val)
+{
+	struct cdc_dev *dev = data;
+
+	*val = READ_ONCE(dev->underrun_tune.step);
+
+	return 0;
+}
+
+static int cdc_stats_tune_step_set(void *data, u64 val)
+{
+	struct cdc_dev *dev = data;
+
+	return cdc_stats_tune_bound_set(dev, &dev->underrun_tune.step, val);
+}
+DEFINE_DEBUGFS_ATTRIBUTE(cdc_stats_tune_step_fops, cdc_stats_tune_step_get,
+		cdc_stats_tune_step_set, "%llu\n");
+
+static const char * const cdc_underrun_decision_names[] =
+{
+	[CDC_UNDERRUN_KEEP] = "start",
+	[CDC_UNDERRUN_RAISE] = "raise",
+	[CDC_UNDERRUN_LOWER] = "lower",
+	[CDC_UNDERRUN_LIMIT] = "limit",
+};
+
+static int cdc_stats_tune_history_show(struct seq_file *s, void *unused)
+{
+	struct cdc_dev *dev = s->private;
+	struct cdc_underrun_stats *st = &dev->underrun;
+	struct cdc_underrun_tune *copy;
+	struct cdc_underrun_step *step;
+	unsigned int i, first;
+
+	copy = kmalloc(sizeof(*copy), GFP_KERNEL);
+	if(!copy)
+		return -ENOMEM;
+
+	spin_lock(&st->lock);
+	memcpy(copy, &dev->underrun_tune, sizeof(*copy));
+	spin_unlock(&st->lock);
+
+	seq_printf(s, "enabled: %u\n", copy->enabled);
+	seq_printf(s, "threshold: %u\n", copy->enabled ? copy->threshold :
+			cdc_reg_read_single(dev, CDC_REG_GLOBAL_UNDERRUN_THRESHOLD));
+	seq_printf(s, "bounds: %u-%u step %u warn_limit %u\n", copy->min,
+			copy->max, copy->step, copy->warn_limit);
+
+	/* oldest first */
+	first = copy->history_head > CDC_UNDERRUN_TUNE_HISTORY ?
+		copy->history_head - CDC_UNDERRUN_TUNE_HISTORY : 0;
+	for(i = first; i < copy->history_head; i++)
+	{
+		step = &copy->history[i % CDC_UNDERRUN_TUNE_HISTORY];
+		seq_printf(s, "%lld: %s threshold %u (warns %u, underruns %u)\n",
+				step->timestamp,
+				cdc_underrun_decision_names[step->decision],
+				step->threshold, step->warns, step->underruns);
+	}
+
+	kfree(copy);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(cdc_stats_tune_history);
+
+int cdc_stats_init(struct cdc_dev *dev)
+{
+	struct cdc_underrun_stats *st = &dev->underrun;
+	struct cdc_underrun_tune *tune = &dev->underrun_tune;
+
+	spin_lock_init(&st->lock);
+	mutex_init(&st->knob_lock);
+	st->event_tail = atomic64_read(&dev->event_head);
+
+	INIT_DELAYED_WORK(&tune->work, cdc_stats_tune_work);
+	tune->min = 0;
+	tune->max = U16_MAX;
+	tune->step = CDC_UNDERRUN_TUNE_STEP;
+	tune->warn_limit = CDC_UNDERRUN_TUNE_WARN_LIMIT;
+
+	dev->debugfs = debugfs_create_dir(dev_name(dev->device), NULL);
+	debugfs_create_file("underrun", S_IRUGO, dev->debugfs, dev,
+			&cdc_stats_underrun_fops);
+	debugfs_create_file_unsafe("underrun_accounting", S_IRUGO | S_IWUSR,
+			dev->debugfs, dev, &cdc_stats_accounting_fops);
+	debugfs_create_file_unsafe("underrun_frame_sampling", S_IRUGO | S_IWUSR,
+			dev->debugfs, dev, &cdc_stats_sampling_fops);
+	debugfs_create_file_unsafe("underrun_reset", S_IWUSR, dev->debugfs, dev,
+			&cdc_stats_reset_fops);
+	debugfs_create_file_unsafe("underrun_tune", S_IRUGO | S_IWUSR,
+			dev->debugfs, dev, &cdc_stats_tune_fops);
+	debugfs_create_file_unsafe("underrun_tune_min", S_IRUGO | S_IWUSR,
+			dev->debugfs, dev, &cdc_stats_tune_min_fops);
+	debugfs_create_file_unsafe("underrun_tune_max", S_IRUGO | S_IWUSR,
+			dev->debugfs, dev, &cdc_stats_tune_max_fops);
+	debugfs_create_file_unsafe("underrun_tune_step", S_IRUGO | S_IWUSR,
+			dev->debugfs, dev, &cdc_stats_tune_step_fops);
+	debugfs_create_u32("underrun_tune_warn_limit", S_IRUGO | S_IWUSR,
+			dev->debugfs, &tune->warn_limit);
+	debugfs_create_file("underrun_tune_history", S_IRUGO, dev->debugfs, dev,
+			&cdc_stats_tune_history_fops);
+	cdc_regcache_debugfs(dev);
+
+	st->irq.mask = CDC_IRQ_FIFO_UNDERRUN_WARN | CDC_IRQ_FIFO_UNDERRUN |
+		CDC_IRQ_LINE;
+	st->irq.handler = cdc_stats_irq;
+	cdc_irq_add_handler(dev, &st->irq);
+
+	if(underrun_accounting)
+		cdc_stats_accounting_enable(dev, 1);
+	if(underrun_frame_sampling)
+		cdc_stats_sampling_set(dev, 1);
+	if(underrun_autotune)
+		cdc_stats_tune_enable(dev, 1);
+
+	return 0;
+}
+
+void cdc_stats_exit(struct cdc_dev *dev)
+{
+	struct cdc_underrun_stats *st = &dev->underrun;
+
+	debugfs_remove_recursive(dev->debugfs);
+	cdc_stats_tune_enable(dev, 0);
+	cdc_stats_accounting_enable(dev, 0);
+	if(st->frame_sampling)
+		cdc_irq_put(dev, CDC_IRQ_LINE);
+	cdc_irq_remove_handler(dev, &st->irq);
+}
@@ -0,0 +1,112 @@
+/* tracepoints of the CDC driver: register traffic, IRQs and commits, for
+ * per frame timelines with ftrace/perf */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM cdc
+
+#if !defined(TES_CDC_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define TES_CDC_TRACE_H_
+
+#include <linux/tracepoint.h>
+#include <linux/device.h>
+#include "tes_cdc_module.h"
+
+DECLARE_EVENT_CLASS(cdc_reg,
+	TP_PROTO(struct cdc_dev *dev, unsigned int reg, u32 value, bool cached),
+	TP_ARGS(dev, reg, value, cached),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev->dma_dev))
+		__field(unsigned int, reg)
+		__field(u32, value)
+		__field(bool, cached)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev->dma_dev));
+		__entry->reg = reg;
+		__entry->value = value;
+		__entry->cached = cached;
+	),
+	TP_printk("%s reg=0x%03x value=0x%08x%s", __get_str(dev),
+		__entry->reg, __entry->value, __entry->cached ? " cached" : "")
+);
+
+/* cached: the write was dropped as the register already holds the value */
+DEFINE_EVENT(cdc_reg, cdc_reg_write,
+	TP_PROTO(struct cdc_dev *dev, unsigned int reg, u32 value, bool cached),
+	TP_ARGS(dev, reg, value, cached)
+);
+
+/* cached: served from the register cache */
+DEFINE_EVENT(cdc_reg, cdc_reg_read,
+	TP_PROTO(struct cdc_dev *dev, unsigned int reg, u32 value, bool cached),
+	TP_ARGS(dev, reg, value, cached)
+);
+
+TRACE_EVENT(cdc_irq,
+	TP_PROTO(struct cdc_dev *dev, u32 status, u32 position),
+	TP_ARGS(dev, status, position),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev->dma_dev))
+		__field(u32, status)
+		__field(u32, position)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev->dma_dev));
+		__entry->status = status;
+		__entry->position = position;
+	),
+	TP_printk("%s status=0x%x line=%u column=%u", __get_str(dev),
+		__entry->status, __entry->position >> 16,
+		__entry->position & 0xffff)
+);
+
+DECLARE_EVENT_CLASS(cdc_commit,
+	TP_PROTO(struct cdc_dev *dev, u64 seq, unsigned int count),
+	TP_ARGS(dev, seq, count),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev->dma_dev))
+		__field(u64, seq)
+		__field(unsigned int, count)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev->dma_dev));
+		__entry->seq = seq;
+		__entry->count = count;
+	),
+	TP_printk("%s seq=%llu layers=%u", __get_str(dev), __entry->seq,
+		__entry->count)
+);
+
+/* accepted by CDC_IOCTL_COMMIT, possibly waiting for its in-fence */
+DEFINE_EVENT(cdc_commit, cdc_commit_submit,
+	TP_PROTO(struct cdc_dev *dev, u64 seq, unsigned int count),
+	TP_ARGS(dev, seq, count)
+);
+
+/* written to the shadow registers, reload requested */
+DEFINE_EVENT(cdc_commit, cdc_commit_flip,
+	TP_PROTO(struct cdc_dev *dev, u64 seq, unsigned int count),
+	TP_ARGS(dev, seq, count)
+);
+
+/* latched by the reload IRQ, its fence is signalled */
+TRACE_EVENT(cdc_commit_retire,
+	TP_PROTO(struct cdc_dev *dev, u64 seq),
+	TP_ARGS(dev, seq),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev->dma_dev))
+		__field(u64, seq)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev->dma_dev));
+		__entry->seq = seq;
+	),
+	TP_printk("%s seq=%llu", __get_str(dev), __entry->seq)
+);
+
+#endif /* TES_CDC_TRACE_H_ */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE tes_cdc_trace
+#include <trace/define_trace.h>